@@ -0,0 +1,68 @@
+// compile_bench.cpp
+// ~~~~~~~~~~~~~~~~~
+// Measures what starting the compiler as a process costs kpc, next to the
+// builds themselves. Times spawning a process that does nothing, the compiler
+// driver and its compiler process on an empty file, and full builds of the TF
+// programs at -O0 and -O2, all through the Compiler class kpc uses. Run from
+// the repository root with make bench.
+#include "../kpc/Compiler.h"
+
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+
+static const int RUNS = 10;
+
+// Best wall time in microseconds of RUNS runs of the compiler with the given
+// arguments, or -1 if a run failed.
+static long long best(const Compiler &compiler,
+                      const std::vector<std::string> &args) {
+  long long fastest = -1;
+  for (int run = 0; run < RUNS; ++run) {
+    std::chrono::steady_clock::time_point start =
+        std::chrono::steady_clock::now();
+    if (!compiler.compile(args)) {
+      return -1;
+    }
+    const long long elapsed =
+        std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - start)
+            .count();
+    if (fastest < 0 || elapsed < fastest) {
+      fastest = elapsed;
+    }
+  }
+  return fastest;
+}
+
+int main() {
+  const Compiler compiler;
+  if (compiler.getName().empty()) {
+    std::cerr << "No viable C compiler found on system!\n";
+    return EXIT_FAILURE;
+  }
+
+  // The cost of a process alone, with nothing to run in it.
+  const std::string cc = compiler.getName();
+  setenv("CC", "true", 1);
+  const long long spawn = best(Compiler(), {});
+  setenv("CC", cc.c_str(), 1);
+
+  std::cout << "Compiler: " << cc << ", best of " << RUNS << " runs\n"
+            << "spawn a process that does nothing     " << spawn << " us\n"
+            << "driver and cc1 on an empty file       "
+            << best(compiler,
+                    {"-E", "-x", "c", "/dev/null", "-o", "/dev/null"})
+            << " us\n";
+  for (const char *program : {"TF_1_fib.c", "TF_2_funcall.c", "TF_3_SPEC.c"}) {
+    for (const char *level : {"-O0", "-O2"}) {
+      std::cout << "build " << program << ' ' << level
+                << std::string(28 - std::string(program).size(), ' ')
+                << best(compiler, {"-w", level, program, "-o", "/dev/null"})
+                << " us\n";
+    }
+  }
+  return EXIT_SUCCESS;
+}
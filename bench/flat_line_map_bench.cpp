@@ -0,0 +1,111 @@
+// flat_line_map_bench.cpp
+// ~~~~~~~~~~~~~~~~~~~~~~~
+// Times the per-line lookups of the transform with a std::map, as the
+// analysis was stored before, and with a FlatLineMap, looked up per line and
+// walked with a cursor as transformProgram does now. Run with make bench.
+#include "../kpc/FlatLineMap.h"
+
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <map>
+#include <string>
+
+// Lines of the simulated file, and every how many lines an entry is stored.
+static const unsigned LINES = 100000;
+static const unsigned SPACING = 3;
+static const int RUNS = 20;
+
+// Best time of RUNS runs of a pass in microseconds. The pass returns a count
+// that is summed so the work is not optimized away.
+template <typename Pass> static long long best(Pass pass, size_t *sink) {
+  long long fastest = -1;
+  for (int run = 0; run < RUNS; ++run) {
+    std::chrono::steady_clock::time_point start =
+        std::chrono::steady_clock::now();
+    *sink += pass();
+    const long long elapsed =
+        std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - start)
+            .count();
+    if (fastest < 0 || elapsed < fastest) {
+      fastest = elapsed;
+    }
+  }
+  return fastest;
+}
+
+int main() {
+  size_t sink = 0;
+
+  // Entries are added in line order, as the AST walk finds them.
+  const long long mapBuild = best(
+      [] {
+        std::map<unsigned, std::string> calls;
+        for (unsigned line = 1; line <= LINES; line += SPACING) {
+          calls[line] = "callee";
+        }
+        return calls.size();
+      },
+      &sink);
+  const long long flatBuild = best(
+      [] {
+        FlatLineMap<std::string> calls;
+        for (unsigned line = 1; line <= LINES; line += SPACING) {
+          calls[line] = "callee";
+        }
+        return calls.size();
+      },
+      &sink);
+
+  std::map<unsigned, std::string> mapCalls;
+  FlatLineMap<std::string> flatCalls;
+  for (unsigned line = 1; line <= LINES; line += SPACING) {
+    mapCalls[line] = "callee";
+    flatCalls[line] = "callee";
+  }
+
+  // One lookup per source line.
+  const long long mapFind = best(
+      [&mapCalls] {
+        size_t found = 0;
+        for (unsigned line = 1; line <= LINES; ++line) {
+          found += mapCalls.find(line) != mapCalls.end();
+        }
+        return found;
+      },
+      &sink);
+  const long long flatFind = best(
+      [&flatCalls] {
+        size_t found = 0;
+        for (unsigned line = 1; line <= LINES; ++line) {
+          found += flatCalls.find(line) != flatCalls.end();
+        }
+        return found;
+      },
+      &sink);
+
+  // One cursor advanced alongside the source lines.
+  const long long flatCursor = best(
+      [&flatCalls] {
+        size_t found = 0;
+        FlatLineMap<std::string>::const_iterator next = flatCalls.begin();
+        for (unsigned line = 1; line <= LINES; ++line) {
+          while (next != flatCalls.end() && next->first < line) {
+            ++next;
+          }
+          found += next != flatCalls.end() && next->first == line;
+        }
+        return found;
+      },
+      &sink);
+
+  std::cout << LINES << " lines, an entry every " << SPACING
+            << " lines, best of " << RUNS << " runs\n"
+            << "build     std::map " << mapBuild << " us, FlatLineMap "
+            << flatBuild << " us\n"
+            << "find      std::map " << mapFind << " us, FlatLineMap "
+            << flatFind << " us\n"
+            << "cursor    FlatLineMap " << flatCursor << " us\n";
+  return sink == 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,67 @@
+#!/bin/bash
+# Times the parse and AST walk of kpc on TF_3_SPEC.c and on generated files of
+# 12.5k to 100k lines, run from the repository root with make bench. Every
+# generated function is one large scope of declarations and calls, which is
+# where a walk that re-visits siblings grows quadratically. A linear walk
+# roughly doubles its time with every doubling of the lines.
+#
+# Pass a second kpc binary, e.g. one built from an older commit, to time both:
+#   bench/visit_bench.sh bin/kpc /tmp/kpc-before/bin/kpc
+KPC=${1:-bin/kpc}
+BEFORE=$2
+SIZES=${SIZES:-"12500 25000 50000 100000"}
+
+# Write a C file of about $1 lines to $2, in functions of 1000 lines.
+generate() {
+  awk -v lines="$1" 'BEGIN {
+    funcs = int(lines / 1000);
+    print "int leaf(int a) { return a + 1; }\n";
+    for (f = 0; f < funcs; ++f) {
+      printf "int f_%d(int a) {\n", f;
+      for (s = 0; s < 496; ++s) {
+        printf "  int v_%d = leaf(a);\n", s;
+        printf "  a = a + v_%d;\n", s;
+      }
+      print "  if (a > 0) {\n    a = leaf(a);\n  }";
+      print "  return a;\n}\n";
+    }
+    print "int main(void) {\n  int result = 0;";
+    for (f = 0; f < funcs; ++f) {
+      printf "  result += f_%d(%d);\n", f, f;
+    }
+    print "  return result;\n}";
+  }' > "$2"
+}
+
+# Print the milliseconds kpc $1 takes on file $2, and the time it reports for
+# collecting cursors when it reports one. Prompts are answered with no.
+run() {
+  local start end collected
+  rm -f "out/$(basename "$2").kpc_cache"
+  start=$(date +%s%N)
+  printf '%s\nn\nn\n' "$2" | "$1" --no-cache > /dev/null 2>&1
+  end=$(date +%s%N)
+  collected=$(printf '%s\nn\nn\n' "$2" |
+              "$1" --debug --no-cache 2>/dev/null |
+              grep -o 'Collected cursors in [0-9]* us')
+  printf '%10d ms  %s' $(((end - start) / 1000000)) "${collected#Collected cursors in }"
+}
+
+mkdir -p out
+printf '%-16s %8s  %-26s' "file" "lines" "$KPC"
+[ -n "$BEFORE" ] && printf '  %s' "$BEFORE"
+printf '\n'
+
+files="TF_3_SPEC.c"
+for size in $SIZES; do
+  generate "$size" "bench_$size.c"
+  files="$files bench_$size.c"
+done
+for file in $files; do
+  printf '%-16s %8d  %-26s' "$file" "$(wc -l < "$file")" "$(run "$KPC" "$file")"
+  [ -n "$BEFORE" ] && printf '  %s' "$(run "$BEFORE" "$file")"
+  printf '\n'
+done
+for size in $SIZES; do
+  rm -f "bench_$size.c"
+done
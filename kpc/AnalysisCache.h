@@ -0,0 +1,80 @@
+// AnalysisCache.h
+// ~~~~~~~~~~~~~~~
+// Compact binary reader/writer for the on-disk analysis cache.
+#ifndef ANALYSIS_CACHE__H
+#define ANALYSIS_CACHE__H
+
+#include <cstdint>
+#include <fstream>
+#include <string>
+
+// Bumped whenever the layout of the cache file changes, or what the analysis
+// collects from the same source does, e.g. how calls or pointers are
+// resolved, so stale caches are ignored rather than misread or served with
+// outdated results.
+#define ANALYSIS_CACHE_VERSION 4
+#define ANALYSIS_CACHE_MAGIC 0x4b504343 // 'KPCC'
+
+// Writes fixed width integers and length prefixed strings.
+class CacheWriter {
+  std::ofstream out;
+
+public:
+  explicit CacheWriter(const std::string &path)
+      : out(path, std::ios::binary | std::ios::trunc) {}
+
+  bool good() const { return out.good(); }
+
+  void writeU32(uint32_t value) {
+    out.write(reinterpret_cast<const char *>(&value), sizeof(value));
+  }
+
+  void writeU64(uint64_t value) {
+    out.write(reinterpret_cast<const char *>(&value), sizeof(value));
+  }
+
+  void writeString(const std::string &str) {
+    writeU32(str.size());
+    out.write(str.data(), str.size());
+  }
+};
+
+// Reads back what CacheWriter wrote. Any short read marks the reader as bad,
+// callers check good() once after reading everything.
+class CacheReader {
+  std::ifstream in;
+
+public:
+  explicit CacheReader(const std::string &path)
+      : in(path, std::ios::binary) {}
+
+  bool good() const { return in.good(); }
+
+  uint32_t readU32() {
+    uint32_t value = 0;
+    in.read(reinterpret_cast<char *>(&value), sizeof(value));
+    return value;
+  }
+
+  uint64_t readU64() {
+    uint64_t value = 0;
+    in.read(reinterpret_cast<char *>(&value), sizeof(value));
+    return value;
+  }
+
+  std::string readString() {
+    uint32_t size = readU32();
+    std::string str;
+    // Nothing we cache comes close to this, treat it as corruption.
+    if (size > (1u << 24)) {
+      in.setstate(std::ios::failbit);
+    }
+    if (in.good()) {
+      str.resize(size);
+      in.read(&str[0], size);
+    }
+    return str;
+  }
+};
+
+#endif // ANALYSIS_CACHE__H
@@ -0,0 +1,280 @@
+// BatchCollector.cpp
+// ~~~~~~~~~~~~~~~~~~
+// Implementation of BatchCollector interface.
+#include "BatchCollector.h"
+
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <set>
+#include <sstream>
+
+#include "Common.h"
+#include "KeyPointsCollector.h"
+#include "WorkerPool.h"
+
+namespace fs = std::filesystem;
+
+// Returns a path for the given file that stays inside the out directory when
+// appended to it: relative to the working directory where possible, absolute
+// otherwise.
+static std::string normalizeFilename(const fs::path &path) {
+  fs::path absolute = fs::absolute(path).lexically_normal();
+  fs::path relative = absolute.lexically_relative(fs::current_path());
+  if (relative.empty() || *relative.begin() == "..") {
+    return absolute.string();
+  }
+  return relative.string();
+}
+
+// Ctor Implementation
+BatchCollector::BatchCollector(const std::string &projectPath,
+                               const KPCOptions &options, unsigned jobs)
+    : projectPath(projectPath), options(options), jobs(jobs) {
+  if (fs::is_directory(projectPath)) {
+    // A directory holding a compilation database is treated as one.
+    if (fs::exists(fs::path(projectPath) / "compile_commands.json")) {
+      collectFromCompilationDatabase();
+    } else {
+      collectFromDirectory();
+    }
+  } else if (fs::path(projectPath).filename() == "compile_commands.json") {
+    collectFromCompilationDatabase();
+  } else {
+    std::cerr << "Batch path: " << projectPath
+              << ", is not a directory or compile_commands.json! Exiting...\n";
+    exit(EXIT_FAILURE);
+  }
+
+  // Sort so the processing order, and therefore the output, is stable.
+  std::sort(entries.begin(), entries.end(),
+            [](const BatchEntry &A, const BatchEntry &B) {
+              return A.filename < B.filename;
+            });
+  std::cout << "Found " << entries.size() << " translation units in "
+            << projectPath << '\n';
+}
+
+// Is the file a copy of a source that kpc wrote, a formatted or modified
+// program?
+static bool isKPCOutput(const fs::path &path) {
+  const std::string name = path.filename().string();
+  for (const std::string suffix : {".formatted.c", ".modified.c"}) {
+    if (name.size() > suffix.size() &&
+        name.compare(name.size() - suffix.size(), suffix.size(), suffix) ==
+            0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void BatchCollector::collectFromDirectory() {
+  for (fs::recursive_directory_iterator entry(projectPath), end; entry != end;
+       ++entry) {
+    // Skip the out directory, e.g. when the project is the working
+    // directory, everything in it was written by the KPC.
+    std::error_code error;
+    if (entry->is_directory() &&
+        fs::equivalent(entry->path(), OUT_DIR, error)) {
+      entry.disable_recursion_pending();
+      continue;
+    }
+    if (!entry->is_regular_file() || entry->path().extension() != ".c" ||
+        isKPCOutput(entry->path())) {
+      continue;
+    }
+    entries.emplace_back(normalizeFilename(entry->path()),
+                         std::vector<std::string>());
+  }
+}
+
+void BatchCollector::collectFromCompilationDatabase() {
+  fs::path databaseDir = fs::is_directory(projectPath)
+                             ? fs::path(projectPath)
+                             : fs::path(projectPath).parent_path();
+  if (databaseDir.empty()) {
+    databaseDir = ".";
+  }
+
+  CXCompilationDatabase_Error error;
+  CXCompilationDatabase database = clang_CompilationDatabase_fromDirectory(
+      databaseDir.string().c_str(), &error);
+  if (error != CXCompilationDatabase_NoError) {
+    std::cerr << "Could not load compilation database from: " << databaseDir
+              << "! Exiting...\n";
+    exit(EXIT_FAILURE);
+  }
+
+  CXCompileCommands commands =
+      clang_CompilationDatabase_getAllCompileCommands(database);
+  std::set<std::string> seenFiles;
+  for (unsigned idx = 0; idx < clang_CompileCommands_getSize(commands); ++idx) {
+    CXCompileCommand command = clang_CompileCommands_getCommand(commands, idx);
+
+    CXString directoryStr = clang_CompileCommand_getDirectory(command);
+    CXString filenameStr = clang_CompileCommand_getFilename(command);
+    const std::string directory(CXSTR(directoryStr));
+    fs::path sourcePath(CXSTR(filenameStr));
+    clang_disposeString(directoryStr);
+    clang_disposeString(filenameStr);
+
+    if (sourcePath.extension() != ".c") {
+      continue;
+    }
+    if (sourcePath.is_relative()) {
+      sourcePath = fs::path(directory) / sourcePath;
+    }
+
+    // A file may be built more than once, only analyze it the first time.
+    const std::string filename = normalizeFilename(sourcePath);
+    if (!seenFiles.insert(filename).second) {
+      continue;
+    }
+
+    std::vector<std::string> rawArgs;
+    for (unsigned arg = 0; arg < clang_CompileCommand_getNumArgs(command);
+         ++arg) {
+      CXString argStr = clang_CompileCommand_getArg(command, arg);
+      rawArgs.emplace_back(CXSTR(argStr));
+      clang_disposeString(argStr);
+    }
+    entries.emplace_back(
+        filename, filterCompileArgs(rawArgs, directory, sourcePath.string()));
+  }
+
+  clang_CompileCommands_dispose(commands);
+  clang_CompilationDatabase_dispose(database);
+}
+
+// Splits a flag given in its joined form, e.g. '-ofoo.o', into the flag and
+// its value. Returns false if arg is none of the flags followed by a value.
+static bool splitJoinedFlag(const std::string &arg,
+                            const std::vector<std::string> &flags,
+                            std::string *flag, std::string *value) {
+  for (const std::string &candidate : flags) {
+    if (arg.size() > candidate.size() && arg.rfind(candidate, 0) == 0) {
+      *flag = candidate;
+      *value = arg.substr(candidate.size());
+      return true;
+    }
+  }
+  return false;
+}
+
+std::vector<std::string>
+BatchCollector::filterCompileArgs(const std::vector<std::string> &rawArgs,
+                                  const std::string &directory,
+                                  const std::string &filename) {
+  const std::vector<std::string> pathFlags = {"-I", "-isystem", "-iquote",
+                                              "-include"};
+  const std::vector<std::string> droppedWithValue = {"-o", "-MF", "-MT",
+                                                     "-MQ"};
+  const std::vector<std::string> dropped = {"-c", "-MD", "-MMD", "-MP"};
+  // '-include' is left out, '-include-pch' would read as a joined form.
+  const std::vector<std::string> joinedPathFlags = {"-I", "-isystem",
+                                                    "-iquote"};
+  const fs::path absoluteSource = fs::absolute(filename).lexically_normal();
+
+  // Makes a path argument absolute against the command's directory.
+  auto absolutize = [&directory](const std::string &path) {
+    fs::path argPath(path);
+    return argPath.is_relative() ? (fs::path(directory) / argPath).string()
+                                 : path;
+  };
+
+  std::vector<std::string> filtered;
+  // First argument is always the compiler itself.
+  for (size_t idx = 1; idx < rawArgs.size(); ++idx) {
+    const std::string &arg = rawArgs[idx];
+    if (std::find(dropped.begin(), dropped.end(), arg) != dropped.end()) {
+      continue;
+    }
+    if (std::find(droppedWithValue.begin(), droppedWithValue.end(), arg) !=
+        droppedWithValue.end()) {
+      ++idx;
+      continue;
+    }
+    if (std::find(pathFlags.begin(), pathFlags.end(), arg) != pathFlags.end() &&
+        idx + 1 < rawArgs.size()) {
+      filtered.push_back(arg);
+      filtered.push_back(absolutize(rawArgs[++idx]));
+      continue;
+    }
+    std::string flag;
+    std::string value;
+    if (splitJoinedFlag(arg, droppedWithValue, &flag, &value)) {
+      continue;
+    }
+    if (splitJoinedFlag(arg, joinedPathFlags, &flag, &value)) {
+      filtered.push_back(flag + absolutize(value));
+      continue;
+    }
+    // Drop the source file itself.
+    if (arg[0] != '-' &&
+        fs::absolute(fs::path(directory) / arg).lexically_normal() ==
+            absoluteSource) {
+      continue;
+    }
+    filtered.push_back(arg);
+  }
+  return filtered;
+}
+
+unsigned BatchCollector::run() {
+  WorkerPool pool(jobs);
+
+  // One index per worker, a CXIndex is not safe to share across threads.
+  std::vector<CXIndex> indices;
+  for (unsigned worker = 0; worker < pool.size(); ++worker) {
+    indices.push_back(clang_createIndex(0, 0));
+  }
+
+  // Results are stored by entry index, so merging is independent of which
+  // worker finished first.
+  std::vector<std::string> dictionaries(entries.size());
+  std::vector<char> succeeded(entries.size(), 0);
+
+  for (size_t idx = 0; idx < entries.size(); ++idx) {
+    pool.submit([this, idx, &indices, &dictionaries,
+                 &succeeded](unsigned workerId) {
+      const BatchEntry &entry = entries[idx];
+      KPCOptions entryOptions(options);
+      entryOptions.compilerArgs.insert(entryOptions.compilerArgs.end(),
+                                       entry.compilerArgs.begin(),
+                                       entry.compilerArgs.end());
+      KeyPointsCollector kpc(entry.filename, entryOptions, indices[workerId]);
+      succeeded[idx] = kpc.runToolchain();
+      std::stringstream dictionary;
+      kpc.writeBranchDictionary(dictionary, true);
+      dictionaries[idx] = dictionary.str();
+    });
+  }
+  std::cout << "Analyzing with " << pool.size() << " workers\n";
+  pool.run();
+
+  for (CXIndex index : indices) {
+    clang_disposeIndex(index);
+  }
+
+  // Merge the per-file dictionaries.
+  std::ofstream projectDict(std::string(OUT_DIR) + "project.branch_dict");
+  projectDict << "Branch Dictionary for: " << projectPath << '\n';
+  projectDict << "-----------------------"
+              << std::string(projectPath.size(), '-') << '\n';
+  unsigned failures = 0;
+  for (size_t idx = 0; idx < entries.size(); ++idx) {
+    projectDict << dictionaries[idx];
+    if (!succeeded[idx]) {
+      std::cerr << "Failed: " << entries[idx].filename << '\n';
+      ++failures;
+    }
+  }
+  projectDict.close();
+
+  std::cout << "\nBatch complete, " << entries.size() - failures << " of "
+            << entries.size() << " files were instrumented and written to the "
+            << OUT_DIR << " directory\n";
+  return failures;
+}
@@ -0,0 +1,69 @@
+// BatchCollector.h
+// ~~~~~~~~~~~~~~~~
+// Defines the BatchCollector interface, used to run the KPC toolchain over
+// every C file in a directory or compile_commands.json in one process.
+#ifndef BATCH_COLLECTOR__H
+#define BATCH_COLLECTOR__H
+
+#include <string>
+#include <vector>
+
+#include "KPCOptions.h"
+
+class BatchCollector {
+
+  // Directory or compile_commands.json given for analysis.
+  const std::string projectPath;
+
+  // Options forwarded to each KPC instance, compiler arguments are extended
+  // with those of each entry.
+  const KPCOptions options;
+
+  // Number of translation units analyzed at once, 0 uses every core.
+  unsigned jobs;
+
+  // A single translation unit to analyze, with the arguments it was built
+  // with (empty when collected from a plain directory).
+  struct BatchEntry {
+    std::string filename;
+    std::vector<std::string> compilerArgs;
+
+    BatchEntry(const std::string &filename,
+               const std::vector<std::string> &compilerArgs)
+        : filename(filename), compilerArgs(compilerArgs) {}
+  };
+
+  // All translation units found for the project.
+  std::vector<BatchEntry> entries;
+
+  // Recursively collects every .c file under the project directory.
+  void collectFromDirectory();
+
+  // Collects every C translation unit from a compile_commands.json using
+  // LibClang's compilation database API.
+  void collectFromCompilationDatabase();
+
+  // Filters a compile command down to the arguments that matter for parsing:
+  // drops the compiler, the source file, outputs and '-c', and makes relative
+  // include paths absolute against the command's directory. Flags with a
+  // value are handled both separated ('-o foo.o') and joined ('-ofoo.o').
+  static std::vector<std::string>
+  filterCompileArgs(const std::vector<std::string> &rawArgs,
+                    const std::string &directory, const std::string &filename);
+
+public:
+  // Batch ctor, takes a directory or a path to compile_commands.json.
+  BatchCollector(const std::string &projectPath,
+                 const KPCOptions &options = KPCOptions(), unsigned jobs = 0);
+
+  // Returns the translation units found for the project.
+  const std::vector<BatchEntry> &getEntries() const { return entries; }
+
+  // Runs the non-interactive toolchain for every translation unit on a worker
+  // pool, then merges the per-file dictionaries into one project dictionary
+  // in file order, so the result does not depend on scheduling. Returns the
+  // number of files that failed.
+  unsigned run();
+};
+
+#endif // BATCH_COLLECTOR__H
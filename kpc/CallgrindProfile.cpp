@@ -0,0 +1,188 @@
+// CallgrindProfile.cpp
+// ~~~~~~~~~~~~~~~~~~~~
+// Implementation of the CallgrindProfile interface.
+#include "CallgrindProfile.h"
+
+#include <cctype>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <vector>
+
+bool CallgrindProfile::isSourceFile(const std::string &name,
+                                    const std::string &sourcePath) {
+  return name == sourcePath ||
+         (name.size() > sourcePath.size() &&
+          name[name.size() - sourcePath.size() - 1] == '/' &&
+          name.compare(name.size() - sourcePath.size(), sourcePath.size(),
+                       sourcePath) == 0);
+}
+
+std::string CallgrindProfile::functionName(const std::string &name) {
+  const size_t depth = name.find('\'');
+  return depth == std::string::npos ? name : name.substr(0, depth);
+}
+
+bool CallgrindProfile::load(const std::string &sourcePath) {
+  std::ifstream profile(profilePath);
+  if (!profile.good()) {
+    std::cerr << "Could not open Callgrind profile " << profilePath << "!\n";
+    return false;
+  }
+  lineCosts.clear();
+  total = 0;
+
+  // Number of position columns, which of them is the line, and which cost
+  // column holds the instructions.
+  unsigned positions = 1;
+  unsigned lineColumn = 0;
+  unsigned irColumn = 0;
+  // Previous value of every position column, positions may be relative.
+  std::vector<uint64_t> last(positions, 0);
+  // File and function names by compressed id, e.g. '(3)'.
+  std::map<std::string, std::string> files;
+  std::map<std::string, std::string> functions;
+  // Is the file of fl= the source, and is the file of the following cost
+  // lines, which fi= and fe= change for inlined code, the source?
+  bool objectInSource = false;
+  bool inSource = false;
+  // Set after a calls= line, the next cost line is the cost of the call.
+  bool callCost = false;
+  // Callee of the next call, and is it in the source? Without cfi= or cfl=
+  // the callee is in the file of the caller.
+  std::string callee;
+  bool calleeInSource = false;
+  bool calleeFileGiven = false;
+  bool sawFormat = false;
+  bool sawTotal = false;
+  uint64_t summed = 0;
+
+  // Resolves a possibly compressed file or function name, '(id) name'
+  // defines an id and '(id)' refers to one defined before.
+  auto compressedName = [](std::map<std::string, std::string> &names,
+                           const std::string &value) {
+    if (value.empty() || value[0] != '(') {
+      return value;
+    }
+    const size_t close = value.find(')');
+    if (close == std::string::npos) {
+      return value;
+    }
+    const std::string id = value.substr(0, close + 1);
+    const size_t name = value.find_first_not_of(' ', close + 1);
+    if (name != std::string::npos) {
+      names[id] = value.substr(name);
+    }
+    return names[id];
+  };
+  auto fileName = [&](const std::string &value) {
+    return compressedName(files, value);
+  };
+
+  std::string line;
+  while (std::getline(profile, line)) {
+    if (line.empty() || line[0] == '#') {
+      continue;
+    }
+
+    // Cost line: positions followed by costs.
+    const char first = line[0];
+    if (std::isdigit(static_cast<unsigned char>(first)) || first == '+' ||
+        first == '-' || first == '*') {
+      std::istringstream fields(line);
+      std::string field;
+      for (unsigned column = 0; column < positions && fields >> field;
+           ++column) {
+        if (field[0] == '*') {
+          continue;
+        }
+        const uint64_t value =
+            std::strtoull(field.c_str() + (field[0] == '+' || field[0] == '-'),
+                          nullptr, 0);
+        last[column] = field[0] == '+'   ? last[column] + value
+                       : field[0] == '-' ? last[column] - value
+                                         : value;
+      }
+      uint64_t cost = 0;
+      for (unsigned column = 0; column <= irColumn && fields >> field;
+           ++column) {
+        cost = column == irColumn ? std::strtoull(field.c_str(), nullptr, 10)
+                                  : 0;
+      }
+      if (inSource) {
+        LineCost &lineCost = lineCosts[last[lineColumn]];
+        (callCost ? lineCost.calls : lineCost.self) += cost;
+        if (callCost && calleeInSource) {
+          lineCost.sourceCalls[callee] += cost;
+        }
+      }
+      if (!callCost) {
+        summed += cost;
+      }
+      callCost = false;
+      continue;
+    }
+
+    const size_t separator = line.find_first_of("=:");
+    if (separator == std::string::npos) {
+      continue;
+    }
+    const std::string key = line.substr(0, separator);
+    const std::string value = line.substr(separator + 1);
+    std::istringstream words(value);
+    std::string word;
+    if (key == "positions") {
+      sawFormat = true;
+      positions = 0;
+      while (words >> word) {
+        if (word == "line") {
+          lineColumn = positions;
+        }
+        ++positions;
+      }
+      last.assign(positions, 0);
+    } else if (key == "events") {
+      sawFormat = true;
+      for (unsigned column = 0; words >> word; ++column) {
+        if (word == "Ir") {
+          irColumn = column;
+        }
+      }
+    } else if (key == "summary" || key == "totals") {
+      for (unsigned column = 0; column <= irColumn && words >> word;
+           ++column) {
+        total = std::strtoull(word.c_str(), nullptr, 10);
+      }
+      sawTotal = true;
+    } else if (key == "fl") {
+      objectInSource = isSourceFile(fileName(value), sourcePath);
+      inSource = objectInSource;
+    } else if (key == "fi" || key == "fe") {
+      inSource = isSourceFile(fileName(value), sourcePath);
+    } else if (key == "fn") {
+      compressedName(functions, value);
+      inSource = objectInSource;
+    } else if (key == "cfi" || key == "cfl") {
+      calleeInSource = isSourceFile(fileName(value), sourcePath);
+      calleeFileGiven = true;
+    } else if (key == "cfn") {
+      callee = functionName(compressedName(functions, value));
+      if (!calleeFileGiven) {
+        calleeInSource = inSource;
+      }
+    } else if (key == "calls") {
+      callCost = true;
+      calleeFileGiven = false;
+    }
+  }
+
+  if (!sawFormat) {
+    std::cerr << profilePath << " is not a Callgrind profile!\n";
+    return false;
+  }
+  if (!sawTotal) {
+    total = summed;
+  }
+  return true;
+}
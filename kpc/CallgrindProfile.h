@@ -0,0 +1,62 @@
+// CallgrindProfile.h
+// ~~~~~~~~~~~~~~~~~~
+// Defines the CallgrindProfile interface, used to read the per line costs of
+// one source file out of a callgrind.out profile.
+#ifndef CALLGRIND_PROFILE__H
+#define CALLGRIND_PROFILE__H
+
+#include <cstdint>
+#include <map>
+#include <string>
+
+class CallgrindProfile {
+public:
+  // Instructions executed on a source line. Calls made from the line are
+  // kept apart, their cost is everything the callee executed. The part of
+  // it spent in calls to functions of the source file is also kept by
+  // callee name, so recursive calls can be told apart.
+  struct LineCost {
+    uint64_t self = 0;
+    uint64_t calls = 0;
+    std::map<std::string, uint64_t> sourceCalls;
+  };
+
+private:
+  // Path of the callgrind.out profile.
+  const std::string profilePath;
+
+  // Costs by line of the source file asked for.
+  std::map<unsigned, LineCost> lineCosts;
+
+  // Instructions executed by the whole program.
+  uint64_t total;
+
+  // Strips the recursion depth Callgrind appends to the names of recursive
+  // functions, e.g. fib'2.
+  static std::string functionName(const std::string &name);
+
+  // Does a file name from the profile refer to the source file? Names are
+  // whatever the debug info holds, so a relative path may have gained the
+  // compilation directory.
+  static bool isSourceFile(const std::string &name,
+                           const std::string &sourcePath);
+
+public:
+  // Profile at the given path, nothing is read until load().
+  explicit CallgrindProfile(const std::string &profilePath)
+      : profilePath(profilePath), total(0) {}
+
+  // Reads the instruction costs of every line of sourcePath. Returns false if
+  // the profile is missing or not in the callgrind format.
+  bool load(const std::string &sourcePath);
+
+  // Costs by source line, only lines that executed something are present.
+  const std::map<unsigned, LineCost> &getLineCosts() const {
+    return lineCosts;
+  }
+
+  // Instructions executed by the whole program, including libraries.
+  uint64_t getTotal() const { return total; }
+};
+
+#endif // CALLGRIND_PROFILE__H
@@ -1,8 +1,14 @@
 // Common.h
 // ~~~~~~~~
 // Common macros and other globals.
+#ifndef COMMON__H
+#define COMMON__H
+
 #include <clang-c/Index.h>
 
+#include <cstdint>
+#include <string>
+
 #define CXSTR(X) clang_getCString(X)
 #define QKDBG(OUT) std::cout << OUT << '\n';
 #define QKCURSDBG(OUT) std::cout << CXSTR(clang_getCursorKindSpelling(OUT)) << std::endl;
@@ -11,9 +17,24 @@
 #define OUT_DIR "out/"
 #define EXE_OUT std::string(OUT_DIR + filename + ".modified.out")
 #define MODIFIED_PROGAM_OUT std::string(OUT_DIR + filename + ".modified.c")
+#define SHARED_OUT std::string(OUT_DIR + filename + ".modified.so")
 #define ORIGINAL_EXE_OUT std::string(OUT_DIR + filename + ".original.out")
+#define TRACE_OUT std::string(OUT_DIR + filename + ".trace")
+#define COUNTS_OUT std::string(OUT_DIR + filename + ".counts")
+#define COVERAGE_OUT std::string(OUT_DIR + filename + ".coverage")
+#define PROFILE_OUT std::string(OUT_DIR + filename + ".profile")
+
+#define CALLGRIND_LOG std::string(OUT_DIR + filename + ".VALGRIND_OUT")
+#define CALLGRIND_OUT std::string(OUT_DIR + filename + ".callgrind.out")
+#define FORMATTED_OUT std::string(OUT_DIR + filename + ".formatted.c")
+#define COSTS_OUT std::string(OUT_DIR + filename + ".costs")
+#define OPT_REPORT_OUT std::string(OUT_DIR + filename + ".opt_report")
 
-#define VALGRIND_PARSER "valgrind_parser.py"
+// How often a watch session checks the file for changes
+#define WATCH_POLL_MS 200
+
+// Cached precompiled headers for kept include directives
+#define PCH_DIR std::string(OUT_DIR "pch/")
 
 
 #define MAP_FIND(MAP, KEY) MAP.find(KEY) != MAP.end()
@@ -23,9 +44,51 @@
   "#include <stdio.h>\n#define LOG(BP) printf(\"%s\\n\", BP);\n#define "       \
   "LOG_PTR(PTR) printf(\"func_%p\\n\", PTR);\n"
 
-#define DECLARE_BRANCH(BRANCH) "int BRANCH_" << BRANCH << " = 0;\n"
-#define SET_BRANCH(BRANCH) "BRANCH_" << BRANCH << " = 1;\n"
+#define BRANCH_ID(ID) "br_" << ID
+// Every inserted statement is wrapped in KPC_GLOBAL (file scope) or
+// KPC_LOCAL (inside a function), which expand to nothing unless the modified
+// program is compiled with -DKPC_TRACE. With -DKPC_TRACE_ONLY as well, only
+// functions given as -DKPC_TRACE_<name> are traced.
+#define TRACE_SWITCH_HEADER                                                    \
+  "#ifdef KPC_TRACE\n#define KPC_GLOBAL(...) __VA_ARGS__\n#else\n#define "     \
+  "KPC_GLOBAL(...)\n#endif\n#define KPC_LOCAL(...) KPC_GLOBAL(__VA_ARGS__)\n"
+#define FUNCTION_TRACE_SWITCH(NAME)                                            \
+  "#undef KPC_LOCAL\n#if defined(KPC_TRACE) && (!defined(KPC_TRACE_ONLY) || "  \
+  "defined(KPC_TRACE_"                                                         \
+      << NAME                                                                  \
+      << "))\n#define KPC_LOCAL(...) __VA_ARGS__\n#else\n#define "             \
+         "KPC_LOCAL(...)\n#endif\n"
+
+#define DECLARE_BRANCH(BRANCH) "KPC_LOCAL(int BRANCH_" << BRANCH << " = 0;)\n"
+#define SET_BRANCH(BRANCH) "KPC_LOCAL(BRANCH_" << BRANCH << " = 1;)\n"
+
+// Highest index of the branches of a function entered so far, replaces
+// testing every later branch flag.
+#define DECLARE_BRANCH_MAX "KPC_LOCAL(int BRANCH_MAX = -1;)\n"
+#define SET_BRANCH_MAX(BRANCH)                                                 \
+  "KPC_LOCAL(if (BRANCH_MAX < " << BRANCH << ") BRANCH_MAX = " << BRANCH     \
+                                << ";)\n"
+
+// Entry probe of a profiled function, the frame's cleanup is its exit probe.
+#define PROFILE_FUNCTION(ID)                                                   \
+  "KPC_LOCAL(struct kpc_frame kpc_self __attribute__((cleanup(kpc_exit))); "  \
+  "kpc_enter(&kpc_self, "                                                      \
+      << ID << ");)\n"
 #define WRITE_LINE(LINE) LINE << '\n';
 
-#define DECLARE_FUNC_PTR(FUNC)                                                 \
-  FUNC->type << " *" << FUNC->name << "_PTR = &" << FUNC->name << ";\n"
+#define DECLARE_FUNC_PTR(SCOPE, FUNC)                                          \
+  SCOPE "(" << FUNC->type << " *" << FUNC->name << "_PTR = &" << FUNC->name    \
+            << ";)\n"
+
+// 64 bit FNV-1a hash, used to key files written to the out directory by
+// their contents.
+inline uint64_t hashString(const std::string &str,
+                           uint64_t hash = 0xcbf29ce484222325ULL) {
+  for (const char c : str) {
+    hash ^= static_cast<unsigned char>(c);
+    hash *= 0x100000001b3ULL;
+  }
+  return hash;
+}
+
+#endif // COMMON__H
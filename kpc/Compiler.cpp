@@ -0,0 +1,72 @@
+// Compiler.cpp
+// ~~~~~~~~~~~~
+// Implementation of the Compiler interface.
+#include "Compiler.h"
+
+#include <cerrno>
+#include <cstdlib>
+#include <iostream>
+#include <spawn.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+extern char **environ;
+
+Compiler::Compiler() : compiler(findCompiler()) {}
+
+std::string Compiler::findCompiler() {
+  const char *cc = std::getenv("CC");
+  if (cc != nullptr && *cc != '\0') {
+    return cc;
+  }
+  const char *path = std::getenv("PATH");
+  const std::string searchPath(path != nullptr ? path : "/usr/bin:/bin");
+  for (const char *candidate : {"clang", "gcc", "cc"}) {
+    size_t dirStart = 0;
+    while (dirStart <= searchPath.size()) {
+      size_t dirEnd = searchPath.find(':', dirStart);
+      if (dirEnd == std::string::npos) {
+        dirEnd = searchPath.size();
+      }
+      const std::string dir = searchPath.substr(dirStart, dirEnd - dirStart);
+      const std::string executable =
+          (dir.empty() ? "." : dir) + "/" + candidate;
+      if (access(executable.c_str(), X_OK) == 0) {
+        return candidate;
+      }
+      dirStart = dirEnd + 1;
+    }
+  }
+  return std::string();
+}
+
+bool Compiler::compile(const std::vector<std::string> &args,
+                       std::chrono::milliseconds *elapsed) const {
+  if (compiler.empty()) {
+    std::cerr << "No viable C compiler found on system!\n";
+    return false;
+  }
+  std::vector<char *> argv;
+  argv.push_back(const_cast<char *>(compiler.c_str()));
+  for (const std::string &arg : args) {
+    argv.push_back(const_cast<char *>(arg.c_str()));
+  }
+  argv.push_back(nullptr);
+
+  const std::chrono::steady_clock::time_point start =
+      std::chrono::steady_clock::now();
+  pid_t child;
+  if (posix_spawnp(&child, compiler.c_str(), nullptr, nullptr, argv.data(),
+                   environ) != 0) {
+    std::cerr << "Could not run " << compiler << "!\n";
+    return false;
+  }
+  int status;
+  while (waitpid(child, &status, 0) < 0 && errno == EINTR) {
+  }
+  if (elapsed != nullptr) {
+    *elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now() - start);
+  }
+  return WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS;
+}
@@ -0,0 +1,35 @@
+// Compiler.h
+// ~~~~~~~~~~
+// Defines the Compiler interface, used to run the system C compiler on the
+// original and modified programs.
+#ifndef COMPILER__H
+#define COMPILER__H
+
+#include <chrono>
+#include <string>
+#include <vector>
+
+class Compiler {
+
+  // Compiler executable, looked up on the PATH.
+  const std::string compiler;
+
+public:
+  // Uses $CC if set, otherwise whichever of clang, gcc and cc is found first
+  // on the PATH. Picked at run time, not by how kpc itself was built.
+  Compiler();
+
+  // Returns the name of the compiler, empty if none was found.
+  const std::string &getName() const { return compiler; }
+
+  // Returns the compiler a new Compiler would use.
+  static std::string findCompiler();
+
+  // Runs the compiler with the given arguments, spawning it directly so no
+  // shell is started and arguments need no quoting. Sets elapsed to the wall
+  // time of the compile. Returns true if it succeeded.
+  bool compile(const std::vector<std::string> &args,
+               std::chrono::milliseconds *elapsed = nullptr) const;
+};
+
+#endif // COMPILER__H
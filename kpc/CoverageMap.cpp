@@ -0,0 +1,83 @@
+// CoverageMap.cpp
+// ~~~~~~~~~~~~~~~
+// Implementation of the CoverageMap interface.
+#include "CoverageMap.h"
+#include "Common.h"
+
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+
+bool CoverageMap::load(const std::string &path) {
+  std::ifstream in(path, std::ios::binary);
+  if (!in.good()) {
+    std::cerr << "Could not open coverage map " << path << "!\n";
+    return false;
+  }
+  uint32_t header[3];
+  in.read(reinterpret_cast<char *>(header), sizeof(header));
+  if (!in.good() || header[0] != COVERAGE_MAGIC ||
+      header[1] != COVERAGE_VERSION) {
+    std::cerr << path << " is not a KPC coverage map!\n";
+    return false;
+  }
+  buckets.resize(header[2]);
+  in.read(reinterpret_cast<char *>(buckets.data()), buckets.size());
+  if (static_cast<size_t>(in.gcount()) != buckets.size()) {
+    std::cerr << path << " is truncated!\n";
+    buckets.clear();
+    return false;
+  }
+  return true;
+}
+
+bool CoverageMap::save(const std::string &path) const {
+  std::ofstream out(path, std::ios::binary | std::ios::trunc);
+  const uint32_t header[3] = {COVERAGE_MAGIC, COVERAGE_VERSION,
+                              static_cast<uint32_t>(buckets.size())};
+  out.write(reinterpret_cast<const char *>(header), sizeof(header));
+  out.write(reinterpret_cast<const char *>(buckets.data()), buckets.size());
+  if (!out.good()) {
+    std::cerr << "Could not write coverage map " << path << "!\n";
+    return false;
+  }
+  return true;
+}
+
+bool CoverageMap::merge(const CoverageMap &other) {
+  if (buckets.empty()) {
+    buckets.resize(other.buckets.size());
+  }
+  if (buckets.size() != other.buckets.size()) {
+    std::cerr << "Coverage maps have " << buckets.size() << " and "
+              << other.buckets.size() << " edges, they are from different "
+              << "builds!\n";
+    return false;
+  }
+  // Buckets are single bits, so this is the union of what both reached.
+  for (size_t edge = 0; edge < buckets.size(); ++edge) {
+    buckets[edge] |= other.buckets[edge];
+  }
+  return true;
+}
+
+size_t CoverageMap::edgesCovered() const {
+  return buckets.size() - std::count(buckets.begin(), buckets.end(), 0);
+}
+
+void CoverageMap::write(std::ostream &out) const {
+  static const char *const bucketNames[8] = {
+      "1", "2", "3", "4-7", "8-15", "16-31", "32-127", "128+"};
+  for (size_t edge = 0; edge < buckets.size(); ++edge) {
+    if (buckets[edge] == 0) {
+      continue;
+    }
+    out << BRANCH_ID(edge) << ":";
+    for (unsigned bucket = 0; bucket < 8; ++bucket) {
+      if (buckets[edge] & (1u << bucket)) {
+        out << ' ' << bucketNames[bucket];
+      }
+    }
+    out << '\n';
+  }
+}
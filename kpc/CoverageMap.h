@@ -0,0 +1,46 @@
+// CoverageMap.h
+// ~~~~~~~~~~~~~
+// Defines the CoverageMap interface, used to read, merge and write the edge
+// coverage maps a modified program writes in coverage mode.
+#ifndef COVERAGE_MAP__H
+#define COVERAGE_MAP__H
+
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "TraceRuntime.h"
+
+class CoverageMap {
+
+  // One byte per edge, indexed by branch id. Each set bit is a hit count
+  // bucket some run reached: 1, 2, 3, 4-7, 8-15, 16-31, 32-127, 128+.
+  std::vector<uint8_t> buckets;
+
+public:
+  // Empty map, merging into it takes the size of the first map merged.
+  CoverageMap() = default;
+
+  // Reads a map written by the coverage runtime. Returns false if the file is
+  // missing, not a coverage map, or truncated.
+  bool load(const std::string &path);
+
+  // Writes the map in the same layout the runtime does.
+  bool save(const std::string &path) const;
+
+  // Adds the buckets reached by another map. Returns false if the maps are
+  // from builds with a different number of edges.
+  bool merge(const CoverageMap &other);
+
+  // Number of edges in the map.
+  size_t edges() const { return buckets.size(); }
+
+  // Number of edges reached at least once.
+  size_t edgesCovered() const;
+
+  // Writes one 'br_N: buckets' line per reached edge, e.g. 'br_4: 1 4-7'.
+  void write(std::ostream &out) const;
+};
+
+#endif // COVERAGE_MAP__H
@@ -0,0 +1,74 @@
+// FlatLineMap.h
+// ~~~~~~~~~~~~~
+// Defines FlatLineMap, a map keyed by line number stored as one contiguous
+// vector sorted by line.
+#ifndef FLAT_LINE_MAP__H
+#define FLAT_LINE_MAP__H
+
+#include <algorithm>
+#include <utility>
+#include <vector>
+
+// Entries are mostly added in ascending line order while walking the AST, so
+// inserts append in the common case and lookups are a binary search over
+// contiguous memory.
+template <typename T> class FlatLineMap {
+  std::vector<std::pair<unsigned, T>> entries;
+
+public:
+  using iterator = typename std::vector<std::pair<unsigned, T>>::iterator;
+  using const_iterator =
+      typename std::vector<std::pair<unsigned, T>>::const_iterator;
+
+  iterator begin() { return entries.begin(); }
+  iterator end() { return entries.end(); }
+  const_iterator begin() const { return entries.begin(); }
+  const_iterator end() const { return entries.end(); }
+
+  size_t size() const { return entries.size(); }
+  bool empty() const { return entries.empty(); }
+  void clear() { entries.clear(); }
+  void reserve(size_t size) { entries.reserve(size); }
+
+  // First entry at or after the line.
+  iterator lower_bound(unsigned line) {
+    return std::lower_bound(
+        entries.begin(), entries.end(), line,
+        [](const std::pair<unsigned, T> &E, unsigned L) {
+          return E.first < L;
+        });
+  }
+
+  const_iterator lower_bound(unsigned line) const {
+    return std::lower_bound(
+        entries.begin(), entries.end(), line,
+        [](const std::pair<unsigned, T> &E, unsigned L) {
+          return E.first < L;
+        });
+  }
+
+  iterator find(unsigned line) {
+    iterator entry = lower_bound(line);
+    return entry != end() && entry->first == line ? entry : end();
+  }
+
+  const_iterator find(unsigned line) const {
+    const_iterator entry = lower_bound(line);
+    return entry != end() && entry->first == line ? entry : end();
+  }
+
+  // Returns the value for a line, inserting a default one if missing.
+  T &operator[](unsigned line) {
+    if (entries.empty() || entries.back().first < line) {
+      entries.emplace_back(line, T());
+      return entries.back().second;
+    }
+    iterator entry = lower_bound(line);
+    if (entry == end() || entry->first != line) {
+      entry = entries.emplace(entry, line, T());
+    }
+    return entry->second;
+  }
+};
+
+#endif // FLAT_LINE_MAP__H
@@ -0,0 +1,178 @@
+// InstructionCounter.cpp
+// ~~~~~~~~~~~~~~~~~~~~~~
+// Implementation of the InstructionCounter interface.
+#include "InstructionCounter.h"
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <iostream>
+#include <linux/perf_event.h>
+#include <sstream>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+extern char **environ;
+
+int InstructionCounter::openCounter(pid_t pid, uint32_t type,
+                                    uint64_t config) {
+  perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = type;
+  attr.config = config;
+  attr.read_format =
+      PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+  attr.disabled = 1;
+  attr.enable_on_exec = 1;
+  attr.inherit = 1;
+  // Kernel counting needs privileges most users do not have.
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  return static_cast<int>(
+      syscall(SYS_perf_event_open, &attr, pid, -1, -1, PERF_FLAG_FD_CLOEXEC));
+}
+
+bool InstructionCounter::readCounter(int fd, uint64_t *value) {
+  // Value, time enabled, time running.
+  uint64_t values[3];
+  if (fd < 0 || read(fd, values, sizeof(values)) != sizeof(values)) {
+    return false;
+  }
+  *value = values[2] != 0 && values[2] < values[1]
+               ? static_cast<uint64_t>(static_cast<double>(values[0]) *
+                                       values[1] / values[2])
+               : values[0];
+  return true;
+}
+
+bool InstructionCounter::runNative() {
+  // The child waits on the pipe until the counters are attached, then execs
+  // the program, which is when they start counting. Closing the pipe without
+  // writing tells it to give up instead.
+  std::cout.flush();
+
+  // Built before the fork, the child only execs. Inherited variables of the
+  // same name are left out.
+  std::vector<char *> envp;
+  for (const std::string &variable : environment) {
+    envp.push_back(const_cast<char *>(variable.c_str()));
+  }
+  for (char **variable = environ; *variable != nullptr; ++variable) {
+    bool replaced = false;
+    for (const std::string &added : environment) {
+      const size_t nameEnd = added.find('=') + 1;
+      replaced |= std::strncmp(*variable, added.c_str(), nameEnd) == 0;
+    }
+    if (!replaced) {
+      envp.push_back(*variable);
+    }
+  }
+  envp.push_back(nullptr);
+
+  int go[2];
+  if (pipe(go) != 0) {
+    return false;
+  }
+  const pid_t child = fork();
+  if (child < 0) {
+    close(go[0]);
+    close(go[1]);
+    return false;
+  }
+  if (child == 0) {
+    char start;
+    close(go[1]);
+    if (discardOutput) {
+      const int null = open("/dev/null", O_WRONLY);
+      dup2(null, STDOUT_FILENO);
+    }
+    if (read(go[0], &start, 1) == 1) {
+      char *const argv[] = {const_cast<char *>(program.c_str()), nullptr};
+      execve(program.c_str(), argv, envp.data());
+    }
+    _exit(127);
+  }
+  close(go[0]);
+
+  const int instructionsFd =
+      openCounter(child, PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS);
+  const int cyclesFd =
+      openCounter(child, PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES);
+  const int branchMissesFd =
+      openCounter(child, PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES);
+  if (instructionsFd >= 0) {
+    const char start = 1;
+    if (write(go[1], &start, 1) != 1) {
+      std::cerr << "Could not start " << program << "!\n";
+    }
+  }
+  close(go[1]);
+
+  int status;
+  while (waitpid(child, &status, 0) < 0 && errno == EINTR) {
+  }
+  native = readCounter(instructionsFd, &instructions);
+  hasCycles = readCounter(cyclesFd, &cycles);
+  hasBranchMisses = readCounter(branchMissesFd, &branchMisses);
+  for (const int fd : {instructionsFd, cyclesFd, branchMissesFd}) {
+    if (fd >= 0) {
+      close(fd);
+    }
+  }
+  return native;
+}
+
+bool InstructionCounter::runCallgrind() {
+  std::stringstream command;
+  for (const std::string &variable : environment) {
+    command << variable << ' ';
+  }
+  command << "valgrind --tool=callgrind --dump-instr=yes --log-file="
+          << callgrindLog << " --callgrind-out-file=" << callgrindOut << " "
+          << program << (discardOutput ? " > /dev/null" : "");
+  if (system(command.str().c_str()) != EXIT_SUCCESS) {
+    std::cerr << "Valgrind could not be invoked!\n";
+    return false;
+  }
+
+  // The total is the last word of the '==pid== Collected : N' line.
+  std::ifstream log(callgrindLog);
+  std::string line;
+  while (std::getline(log, line)) {
+    const size_t collected = line.find("Collected");
+    const size_t value = line.find_last_of(' ');
+    if (collected != std::string::npos && value != std::string::npos) {
+      instructions = std::strtoull(line.c_str() + value + 1, nullptr, 10);
+      return true;
+    }
+  }
+  std::cerr << "No instruction count found in " << callgrindLog << "!\n";
+  return false;
+}
+
+bool InstructionCounter::run(bool needProfile) {
+  if (needProfile) {
+    return runCallgrind();
+  }
+  if (runNative()) {
+    return true;
+  }
+  std::cout << "Hardware counters are not available, falling back to "
+               "Callgrind\n";
+  return runCallgrind();
+}
+
+void InstructionCounter::print(std::ostream &out) const {
+  out << "The total number of executed instructions for the program was: "
+      << instructions << '\n';
+  if (hasCycles) {
+    out << "CPU cycles: " << cycles << '\n';
+  }
+  if (hasBranchMisses) {
+    out << "Branch misses: " << branchMisses << '\n';
+  }
+}
@@ -0,0 +1,77 @@
+// InstructionCounter.h
+// ~~~~~~~~~~~~~~~~~~~~
+// Defines the InstructionCounter interface, used to count the instructions a
+// program executes with the kernel's hardware counters, or under Callgrind
+// when those are not available.
+#ifndef INSTRUCTION_COUNTER__H
+#define INSTRUCTION_COUNTER__H
+
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <sys/types.h>
+#include <vector>
+
+class InstructionCounter {
+
+  // Executable to run.
+  const std::string program;
+
+  // Where Callgrind writes its log and profile when falling back to it.
+  const std::string callgrindLog;
+  const std::string callgrindOut;
+
+  // Opens a user space counter on pid, disabled until it calls exec and
+  // following the threads and processes it starts. Returns -1 if the counter
+  // is not available.
+  static int openCounter(pid_t pid, uint32_t type, uint64_t config);
+
+  // Reads a counter, scaled up if the kernel had to multiplex it.
+  static bool readCounter(int fd, uint64_t *value);
+
+  // Runs the program with perf_event_open counters. Returns false without
+  // running it if the instruction counter cannot be opened.
+  bool runNative();
+
+  // Runs the program under Callgrind and reads the total from its log.
+  bool runCallgrind();
+
+public:
+  // Counter for the given executable, the Callgrind files are only written
+  // when falling back.
+  InstructionCounter(const std::string &program,
+                     const std::string &callgrindLog,
+                     const std::string &callgrindOut)
+      : program(program), callgrindLog(callgrindLog),
+        callgrindOut(callgrindOut), discardOutput(false), instructions(0),
+        cycles(0), branchMisses(0), hasCycles(false), hasBranchMisses(false),
+        native(false) {}
+
+  // Send what the program prints to /dev/null, e.g. a text trace.
+  bool discardOutput;
+
+  // Variables set for the program as NAME=value, on top of kpc's own
+  // environment, e.g. where it writes its trace.
+  std::vector<std::string> environment;
+
+  // Instructions retired in user space. Cycles and branch misses are only
+  // counted natively, and only where the hardware exposes them.
+  uint64_t instructions;
+  uint64_t cycles;
+  uint64_t branchMisses;
+  bool hasCycles;
+  bool hasBranchMisses;
+
+  // Were the counts read from hardware counters rather than Callgrind?
+  bool native;
+
+  // Runs the program once, counting natively if possible and under Callgrind
+  // otherwise. needProfile always uses Callgrind, as only it leaves a per
+  // line profile behind. Returns false if neither worked.
+  bool run(bool needProfile = false);
+
+  // Writes the counts, one line each.
+  void print(std::ostream &out) const;
+};
+
+#endif // INSTRUCTION_COUNTER__H
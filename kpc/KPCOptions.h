@@ -0,0 +1,87 @@
+// KPCOptions.h
+// ~~~~~~~~~~~~
+// Defines the options used to configure a KeyPointsCollector run.
+#ifndef KPC_OPTIONS__H
+#define KPC_OPTIONS__H
+
+#include <string>
+#include <vector>
+
+// How the modified program records the events it reaches.
+enum class TraceFormat {
+  // printf a line per event to stdout.
+  Text,
+  // Append fixed width records to a buffered binary trace file, decoded
+  // back into text with TraceDecoder.
+  Binary,
+  // Only count how often each branch and function was reached, dumping the
+  // counts at exit.
+  Counters,
+  // Binary trace for multithreaded programs, every thread fills its own
+  // buffer and records carry a global sequence number for merging.
+  Threaded,
+  // Only record which edges of the branch dictionary were reached, and
+  // roughly how often, in a byte per edge map written at exit.
+  Coverage
+};
+
+struct KPCOptions {
+  // Debug option
+  bool debug = false;
+
+  // Keep include directives instead of stripping them before parsing. Headers
+  // are then parsed for real, using a cached precompiled header and a
+  // precompiled preamble, and visitation is limited to the main file.
+  bool keepIncludes = false;
+
+  // Reuse the collected analysis from out/ when the formatted source and
+  // flags have not changed since the last run.
+  bool useCache = true;
+
+  // Format of the trace the modified program writes.
+  TraceFormat traceFormat = TraceFormat::Text;
+
+  // Record only every samplePeriod-th event of each branch and function,
+  // after its first sampleWarmup events. 0 records every event. Only for
+  // binary and threaded traces. Warmups are counted per thread but binary
+  // records carry no thread, so multithreaded programs need a threaded trace
+  // for estimates to be scaled right.
+  unsigned samplePeriod = 0;
+  unsigned sampleWarmup = 16;
+
+  // Time every instrumented function on entry and exit and write a flat
+  // profile of inclusive and exclusive time at exit, alongside the trace.
+  bool profile = false;
+
+  // Count instructions under Callgrind even where hardware counters work,
+  // and report the instructions spent in each function and branch arm.
+  bool attributeCosts = false;
+
+  // Build the original program alongside the modified one in the toolchain,
+  // instead of only when instructions are counted, and report build times.
+  bool concurrentBuild = false;
+
+  // Build the modified program as a shared object and run it inside kpc,
+  // its trace events going straight to a callback. Only for plain binary
+  // traces.
+  bool inProcess = false;
+
+  // Optimization level both programs are compiled at, as given to -O.
+  std::string optLevel = "0";
+
+  // Compare the instructions the original and the modified program execute
+  // at every optimization level after the toolchain has run.
+  bool compareOptLevels = false;
+
+  // Does the modified program write a binary trace for TraceDecoder?
+  bool binaryTrace() const {
+    return traceFormat == TraceFormat::Binary ||
+           traceFormat == TraceFormat::Threaded;
+  }
+
+  // Extra compiler arguments (include paths, defines, language standard) used
+  // both when parsing and when compiling the original and modified programs.
+  std::vector<std::string> compilerArgs;
+};
+
+#endif // KPC_OPTIONS__H
@@ -4,108 +4,275 @@
 #include "KeyPointsCollector.h"
 
 #include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <dlfcn.h>
+#include <filesystem>
 #include <fstream>
+#include <iomanip>
 #include <iostream>
 #include <sstream>
+#include <string_view>
+#include <sys/wait.h>
+#include <thread>
 
+#include "AnalysisCache.h"
 #include "Common.h"
+#include "Compiler.h"
+#include "CoverageMap.h"
+#include "InstructionCounter.h"
+#include "TraceDecoder.h"
+#include "TraceRuntime.h"
+
+// Builds the options for the legacy ctor.
+static KPCOptions makeOptions(bool debug,
+                              const std::vector<std::string> &compilerArgs) {
+  KPCOptions options;
+  options.debug = debug;
+  options.compilerArgs = compilerArgs;
+  return options;
+}
+
 // Ctor Implementation
-KeyPointsCollector::KeyPointsCollector(const std::string &filename, bool debug)
-    : filename(std::move(filename)), debug(debug) {
+KeyPointsCollector::KeyPointsCollector(
+    const std::string &filename, bool debug,
+    const std::vector<std::string> &compilerArgs, CXIndex index)
+    : KeyPointsCollector(filename, makeOptions(debug, compilerArgs), index) {}
+
+KeyPointsCollector::KeyPointsCollector(const std::string &filename,
+                                       const KPCOptions &options,
+                                       CXIndex index)
+    : filename(std::move(filename)), index(index == nullptr ? KPCIndex : index),
+      translationUnit(nullptr), debug(options.debug), options(options),
+      compilerArgs(options.compilerArgs), loaded(false),
+      originalBuilt(false) {
   // Check if file exists
   std::ifstream file(filename);
   if (file.good()) {
     file.close();
 
-    // Format the file
-    std::stringstream formatCommand;
-    formatCommand << "clang-format -i --style=file:file_format_style "
-                  << filename;
-    system(formatCommand.str().c_str());
+    // Make sure the output location for this file exists, files from a batch
+    // may live in nested directories.
+    std::filesystem::create_directories(
+        std::filesystem::path(OUT_DIR + filename).parent_path());
+
+    // Read and format the file into memory.
+    loadSource();
 
     // Remove include directives. We do this before parsing the translation unit
     // as LibClang with parse ALL included files. For the sake of this project,
     // we are only looking at user defined functions, so we dont need to parse
-    // any included files.
-    removeIncludeDirectives();
+    // any included files. When includes are kept, headers come from a PCH
+    // instead and the source is parsed as is.
+    if (options.keepIncludes) {
+      parseBuffer = sourceBuffer;
+    } else {
+      removeIncludeDirectives();
+    }
 
-    // If good, try to parse the translation unit.
-    translationUnit = clang_createTranslationUnitFromSourceFile(
-        KPCIndex, filename.c_str(), 0, nullptr, 0, nullptr);
+    // Init branch count
+    branchCount = 0;
+
+    // An unchanged file can skip parsing and traversal entirely.
+    loadedFromCache = options.useCache && loadCache();
+    if (loadedFromCache) {
+      cxFile = nullptr;
+      loaded = true;
+      std::cout << "Analysis for file: " << filename
+                << " restored from cache.\n";
+      return;
+    }
 
-    // Reinsert the include directives. After the TU has been parsed, we can
-    // reinsert them before transformation.
-    reInsertIncludeDirectives();
+    // If good, try to parse the translation unit.
+    parseTranslationUnit();
 
     // Check if parsed properly
     if (translationUnit == nullptr) {
-      std::cerr
-          << "There was an error parsing the translation unit! Exiting...\n";
-      exit(EXIT_FAILURE);
+      std::cerr << "There was an error parsing the translation unit for file: "
+                << filename << "!\n";
+      return;
     }
     std::cout << "Translation unit for file: " << filename
               << " successfully parsed.\n";
 
-    // Init cursor and branch count
+    // Init cursor
     rootCursor = clang_getTranslationUnitCursor(translationUnit);
     cxFile = clang_getFile(translationUnit, filename.c_str());
-    branchCount = 0;
+    loaded = true;
     // Traverse
   } else {
-    std::cerr << "File with name: " << filename
-              << ", does not exist! Exiting...\n";
-    exit(EXIT_FAILURE);
+    std::cerr << "File with name: " << filename << ", does not exist!\n";
   }
 }
 
 KeyPointsCollector::~KeyPointsCollector() {
-  clang_disposeTranslationUnit(translationUnit);
+  if (translationUnit != nullptr) {
+    clang_disposeTranslationUnit(translationUnit);
+  }
+}
+
+void KeyPointsCollector::loadSource() {
+  // Run clang-format without -i, so the formatted source comes back on stdout
+  // and the original file is left untouched.
+  std::stringstream formatCommand;
+  formatCommand << "clang-format --style=file:file_format_style '" << filename
+                << "' 2>/dev/null";
+  FILE *formatPipe = popen(formatCommand.str().c_str(), "r");
+  if (formatPipe != nullptr) {
+    std::vector<char> buffer(1 << 16);
+    size_t bytesRead;
+    while ((bytesRead = fread(buffer.data(), 1, buffer.size(), formatPipe)) >
+           0) {
+      sourceBuffer.append(buffer.data(), bytesRead);
+    }
+    if (pclose(formatPipe) != EXIT_SUCCESS) {
+      sourceBuffer.clear();
+    }
+  }
+
+  // No formatter, read the file as is.
+  if (sourceBuffer.empty()) {
+    std::ifstream file(filename);
+    std::stringstream contents;
+    contents << file.rdbuf();
+    sourceBuffer = contents.str();
+  }
 }
 
 void KeyPointsCollector::removeIncludeDirectives() {
-  std::ifstream file(filename);
-  std::ofstream tempFile("temp.c");
+  std::istringstream source(sourceBuffer);
   std::string currentLine;
   const std::string includeStr("#include");
   unsigned lineNum = 1;
 
-  if (file.good() && tempFile.good()) {
-    while (getline(file, currentLine)) {
-      if (currentLine.find(includeStr) == 0) {
-        addIncludeDirective(lineNum++, currentLine);
-        continue;
-      }
-      lineNum++;
-      tempFile << currentLine << '\n';
+  parseBuffer.reserve(sourceBuffer.size());
+  while (getline(source, currentLine)) {
+    if (currentLine.find(includeStr) == 0) {
+      addIncludeDirective(lineNum++, currentLine);
+      continue;
     }
+    lineNum++;
+    parseBuffer.append(currentLine).push_back('\n');
   }
-  std::remove(filename.c_str());
-  std::rename("temp.c", filename.c_str());
 }
 
-void KeyPointsCollector::reInsertIncludeDirectives() {
-  std::ifstream file(filename);
-  std::ofstream tempFile("temp.c");
+void KeyPointsCollector::parseTranslationUnit() {
+  std::vector<std::string> parseArgs(compilerArgs);
+  unsigned parseOptions = CXTranslationUnit_None;
+
+  // Keeping includes: pull the headers from a cached PCH, keep a precompiled
+  // preamble for reparses, and skip function bodies in anything but the main
+  // file. The TU is marked incomplete as we only ever visit main file cursors.
+  if (options.keepIncludes) {
+    const std::string pch = getIncludesPCH();
+    if (!pch.empty()) {
+      parseArgs.push_back("-include-pch");
+      parseArgs.push_back(pch);
+    }
+    parseOptions = CXTranslationUnit_PrecompiledPreamble |
+                   CXTranslationUnit_Incomplete |
+                   CXTranslationUnit_SkipFunctionBodies |
+                   CXTranslationUnit_LimitSkipFunctionBodiesToPreamble |
+                   CXTranslationUnit_CreatePreambleOnFirstParse |
+                   CXTranslationUnit_KeepGoing;
+  }
+
+  std::vector<const char *> args;
+  for (const std::string &arg : parseArgs) {
+    args.push_back(arg.c_str());
+  }
+
+  // The buffer is passed as an unsaved file, so nothing is written to disk.
+  CXUnsavedFile unsavedFile = {filename.c_str(), parseBuffer.c_str(),
+                               static_cast<unsigned long>(parseBuffer.size())};
+  translationUnit = clang_parseTranslationUnit(index, filename.c_str(),
+                                               args.data(), args.size(),
+                                               &unsavedFile, 1, parseOptions);
+}
+
+std::string KeyPointsCollector::getIncludesPCH() {
+  // Collect the include directives, they make up the PCH header.
+  std::istringstream source(sourceBuffer);
   std::string currentLine;
-  const std::string includeStr("#include");
-  unsigned lineNum = 1;
+  std::string includes;
+  while (getline(source, currentLine)) {
+    if (currentLine.find("#include") == 0) {
+      includes.append(currentLine).push_back('\n');
+    }
+  }
+  if (includes.empty()) {
+    return std::string();
+  }
 
-  if (file.good() && tempFile.good()) {
-    while (getline(file, currentLine)) {
-      if (MAP_FIND(includeDirectives, lineNum)) {
-        while(MAP_FIND(includeDirectives, lineNum)) {
-          tempFile << includeDirectives[lineNum++] << '\n';
-        }
-        tempFile << currentLine << '\n';
-      } else {
-        lineNum++;
-        tempFile << currentLine << '\n';
-      }
+  // The header is parsed from under the out directory, so quoted includes are
+  // looked up in the source's directory explicitly, first as they would be
+  // from the source itself.
+  const std::string sourceDir =
+      "-iquote" + std::filesystem::absolute(filename).parent_path().string();
+
+  // Files with the same includes, flags and directory share one PCH, files in
+  // different directories may see different local headers.
+  uint64_t key = hashString(includes);
+  key = hashString(sourceDir, key);
+  for (const std::string &arg : compilerArgs) {
+    key = hashString(arg, key);
+  }
+  std::stringstream keyStream;
+  keyStream << std::hex << key;
+  const std::string header = PCH_DIR + keyStream.str() + ".h";
+  const std::string pch = PCH_DIR + keyStream.str() + ".pch";
+  if (std::filesystem::exists(pch)) {
+    return pch;
+  }
+
+  // Build the header TU. It is written under the out directory, as clang checks
+  // the PCH inputs still exist when loading it.
+  std::filesystem::create_directories(PCH_DIR);
+  {
+    std::ofstream headerFile(header);
+    headerFile << includes;
+  }
+  std::vector<const char *> args = {"-x", "c-header", sourceDir.c_str()};
+  for (const std::string &arg : compilerArgs) {
+    args.push_back(arg.c_str());
+  }
+  CXTranslationUnit headerTU = clang_parseTranslationUnit(
+      index, header.c_str(), args.data(), args.size(), nullptr, 0,
+      CXTranslationUnit_ForSerialization | CXTranslationUnit_Incomplete |
+          CXTranslationUnit_SkipFunctionBodies);
+  if (headerTU == nullptr) {
+    return std::string();
+  }
+
+  // Headers that did not resolve, e.g. a missing local include, are not
+  // cached. The source is then parsed with its includes as they are.
+  for (unsigned diag = 0; diag < clang_getNumDiagnostics(headerTU); ++diag) {
+    CXDiagnostic diagnostic = clang_getDiagnostic(headerTU, diag);
+    const bool error =
+        clang_getDiagnosticSeverity(diagnostic) >= CXDiagnostic_Error;
+    clang_disposeDiagnostic(diagnostic);
+    if (error) {
+      clang_disposeTranslationUnit(headerTU);
+      return std::string();
     }
   }
 
-  std::remove(filename.c_str());
-  std::rename("temp.c", filename.c_str());
+  // Save under a unique name and rename, parallel workers may race to build
+  // the same PCH.
+  std::stringstream tempPch;
+  tempPch << pch << '.' << this;
+  const int saved = clang_saveTranslationUnit(
+      headerTU, tempPch.str().c_str(), clang_defaultSaveOptions(headerTU));
+  clang_disposeTranslationUnit(headerTU);
+  if (saved != CXSaveError_None) {
+    std::remove(tempPch.str().c_str());
+    return std::string();
+  }
+  std::rename(tempPch.str().c_str(), pch.c_str());
+  if (debug) {
+    std::cout << "Built precompiled header: " << pch << '\n';
+  }
+  return pch;
 }
 
 bool KeyPointsCollector::isBranchPointOrCallExpr(const CXCursorKind K) {
@@ -163,12 +330,19 @@ CXChildVisitResult KeyPointsCollector::VisitorFunctionCore(CXCursor current,
   const CXCursorKind currKind = clang_getCursorKind(current);
   const CXCursorKind parrKind = clang_getCursorKind(parent);
 
-  // If it is a call expression, recurse on children with special visitor
-  if (currKind == CXCursor_CallExpr) {
-    clang_visitChildren(parent, &KeyPointsCollector::VisitCallExpr, kpc);
+  // Only user code in the main file is of interest, skip anything pulled in
+  // from headers.
+  if (!clang_Location_isFromMainFile(clang_getCursorLocation(current))) {
     return CXChildVisit_Continue;
   }
 
+  // Entering a new top level function, anything still pending belongs to the
+  // previous one and will not find any more targets.
+  if (currKind == CXCursor_FunctionDecl &&
+      parrKind == CXCursor_TranslationUnit) {
+    instance->completePendingBranches();
+  }
+
   // If parent a branch point, and current is a compount statement,
   // warm up the KPC for analysis of said branch.
   if (instance->isBranchPointOrCallExpr(parrKind) &&
@@ -209,14 +383,23 @@ CXChildVisitResult KeyPointsCollector::VisitorFunctionCore(CXCursor current,
     instance->addCompletedBranch();
   }
 
-  // If check to see if it is a FuncDecl
-  if (currKind == CXCursor_FunctionDecl) {
+  // Everything below is collected from the current cursor alone, the walk
+  // then recurses as usual, so each node is only visited once.
+  switch (currKind) {
+  // Only looks at the first child, which is enough to tell a definition or a
+  // declaration with parameters.
+  case CXCursor_FunctionDecl:
     clang_visitChildren(current, &KeyPointsCollector::VisitFuncDecl, kpc);
-  }
-
-  // If check to see if it is a VarDecl
-  if (currKind == CXCursor_VarDecl || currKind == CXCursor_ParmDecl) {
-    clang_visitChildren(parent, &KeyPointsCollector::VisitVarOrParamDecl, kpc);
+    break;
+  case CXCursor_CallExpr:
+    instance->collectCall(current);
+    break;
+  case CXCursor_VarDecl:
+  case CXCursor_ParmDecl:
+    VisitVarOrParamDecl(current, parent, kpc);
+    break;
+  default:
+    break;
   }
 
   return CXChildVisit_Recurse;
@@ -226,7 +409,6 @@ CXChildVisitResult KeyPointsCollector::VisitCompoundStmt(CXCursor current,
                                                          CXCursor parent,
                                                          CXClientData kpc) {
   KeyPointsCollector *instance = static_cast<KeyPointsCollector *>(kpc);
-  const CXCursorKind currKind = clang_getCursorKind(current);
   const CXCursorKind parrKind = clang_getCursorKind(parent);
   if (parrKind != CXCursor_CompoundStmt) {
     std::cerr << "Compound statement visitor called when cursor is not "
@@ -248,46 +430,102 @@ CXChildVisitResult KeyPointsCollector::VisitCompoundStmt(CXCursor current,
   return CXChildVisit_Continue;
 }
 
-CXChildVisitResult KeyPointsCollector::VisitCallExpr(CXCursor current,
-                                                     CXCursor parent,
-                                                     CXClientData kpc) {
-  KeyPointsCollector *instance = static_cast<KeyPointsCollector *>(kpc);
-
-  CXSourceLocation callExprLoc = clang_getCursorLocation(current);
-  CXToken *calleeNameTok = clang_getToken(instance->getTU(), callExprLoc);
-  CXString calleeNameStr =
-      clang_getTokenSpelling(instance->getTU(), *calleeNameTok);
-  std::string calleeName(clang_getCString(calleeNameStr));
+void KeyPointsCollector::internFunction(
+    CXCursor C, std::shared_ptr<FunctionDeclInfo> decl) {
+  CXString usrStr = clang_getCursorUSR(C);
+  const std::string usr(CXSTR(usrStr));
+  clang_disposeString(usrStr);
+
+  std::unordered_map<std::string, unsigned>::iterator interned =
+      funcIdsByUSR.find(usr);
+  if (interned == funcIdsByUSR.end()) {
+    interned = funcIdsByUSR.emplace(usr, funcsById.size()).first;
+    funcsById.push_back(nullptr);
+  }
+  decl->id = interned->second;
+  funcsById[decl->id] = decl;
+  funcIdsByCursor.insert(clang_getCanonicalCursor(C), decl->id);
+}
 
-  if (MAP_FIND(instance->funcDeclsString, calleeName)) {
-    unsigned callLocLine;
-    clang_getSpellingLocation(callExprLoc, instance->getCXFile(), &callLocLine,
-                              nullptr, nullptr);
-    instance->addCall(callLocLine + instance->getNumIncludeDirectives(),
-                      calleeName);
-    // Possibly set recursion flag for function being called.
+std::shared_ptr<KeyPointsCollector::FunctionDeclInfo>
+KeyPointsCollector::resolveCallee(CXCursor C, bool *viaPointer) {
+  CXCursor referenced = clang_getCursorReferenced(C);
+  if (clang_Cursor_isNull(referenced)) {
+    return nullptr;
+  }
 
-    if (instance->getFunctionByName(calleeName)->isInBody(callLocLine)) {
-      instance->getFunctionByName(calleeName)->setRecursive();
+  unsigned id;
+  switch (clang_getCursorKind(referenced)) {
+  case CXCursor_FunctionDecl:
+    if (funcIdsByCursor.find(clang_getCanonicalCursor(referenced), &id)) {
+      *viaPointer = false;
+      return funcsById[id];
+    }
+    return nullptr;
+  case CXCursor_VarDecl:
+  case CXCursor_ParmDecl: {
+    if (!isFunctionPtr(referenced)) {
+      return nullptr;
+    }
+    *viaPointer = true;
+    if (funcPtrIdsByCursor.find(clang_getCanonicalCursor(referenced), &id)) {
+      return funcsById[id];
     }
-    clang_disposeTokens(instance->getTU(), calleeNameTok, 1);
-    clang_disposeString(calleeNameStr);
+    // Pointers declared in functions restored by a watch session have no
+    // cursor entry, fall back to their name.
+    CXString ptrNameStr = clang_getCursorSpelling(referenced);
+    const std::string ptrName(CXSTR(ptrNameStr));
+    clang_disposeString(ptrNameStr);
+    if (MAP_FIND(funcPtrs, ptrName)) {
+      return getFunctionByName(funcPtrs[ptrName]);
+    }
+    return nullptr;
+  }
+  default:
+    return nullptr;
+  }
+}
 
-    return CXChildVisit_Break;
-  } else if (MAP_FIND(instance->funcPtrs, calleeName)) {
-    unsigned callLocLine;
-    clang_getSpellingLocation(callExprLoc, instance->getCXFile(), &callLocLine,
-                              nullptr, nullptr);
-    instance->addCall(callLocLine + instance->getNumIncludeDirectives(),
-                      instance->funcPtrs[calleeName]);
-    clang_disposeTokens(instance->getTU(), calleeNameTok, 1);
-    clang_disposeString(calleeNameStr);
-    return CXChildVisit_Break;
+CXChildVisitResult KeyPointsCollector::VisitFirstChild(CXCursor current,
+                                                       CXCursor /*parent*/,
+                                                       CXClientData child) {
+  *static_cast<CXCursor *>(child) = current;
+  return CXChildVisit_Break;
+}
+
+void KeyPointsCollector::collectCall(CXCursor callExpr) {
+  // Resolve through the referenced declaration. For calls like
+  // (*add_ptr)(2, 2) nothing is referenced until the DeclRefExpr, so follow
+  // the callee expression down its first children. Only the callee is walked,
+  // never the siblings of the call.
+  bool viaPointer = false;
+  std::shared_ptr<FunctionDeclInfo> callee;
+  CXCursor C = callExpr;
+  while (callee == nullptr && !clang_Cursor_isNull(C)) {
+    callee = resolveCallee(C, &viaPointer);
+    CXCursor child = clang_getNullCursor();
+    clang_visitChildren(C, &KeyPointsCollector::VisitFirstChild, &child);
+    C = child;
+  }
+  if (callee == nullptr) {
+    return;
   }
-  clang_disposeString(calleeNameStr);
-  clang_disposeTokens(instance->getTU(), calleeNameTok, 1);
 
-  return CXChildVisit_Recurse;
+  unsigned callLocLine;
+  clang_getSpellingLocation(clang_getCursorLocation(callExpr), getCXFile(),
+                            &callLocLine, nullptr, nullptr);
+  callLocLine += getNumIncludeDirectives();
+
+  // One call is logged per line. Outer calls are visited before the calls in
+  // their arguments, so for foo(bar(1)) keep foo.
+  if (functionCalls.find(callLocLine) == functionCalls.end()) {
+    addCall(callLocLine, callee->name);
+  }
+
+  // Possibly set recursion flag for function being called.
+  if (!viaPointer && callee->isInBody(callLocLine)) {
+    callee->setRecursive();
+  }
 }
 
 CXChildVisitResult KeyPointsCollector::VisitFuncPtr(CXCursor current,
@@ -295,46 +533,27 @@ CXChildVisitResult KeyPointsCollector::VisitFuncPtr(CXCursor current,
                                                     CXClientData kpc) {
   KeyPointsCollector *instance = static_cast<KeyPointsCollector *>(kpc);
 
-  // Get name of ptr
-  CXSourceLocation funcPtrLoc = clang_getCursorLocation(parent);
-  CXToken *funcPtrTok = clang_getToken(instance->getTU(), funcPtrLoc);
-  CXString funcPtrStr = clang_getTokenSpelling(instance->getTU(), *funcPtrTok);
-  std::string funcPtrName(clang_getCString(funcPtrStr));
-
-  // If no key in map, add a nullptr
-  if (!(MAP_FIND(instance->funcPtrs, funcPtrName)) &&
-      instance->currFuncPtrId.empty()) {
-    instance->currFuncPtrId = funcPtrName;
-  }
-
-  // Get name of pointee
-  CXSourceLocation funcPteeLoc = clang_getCursorLocation(current);
-  CXToken *funcPteeTok = clang_getToken(instance->getTU(), funcPteeLoc);
-  CXString funcPteeStr =
-      clang_getTokenSpelling(instance->getTU(), *funcPteeTok);
-  std::string funcPteeName(clang_getCString(funcPteeStr));
-
   // Check pointee points to function.
-  if (instance->getFunctionByName(funcPteeName) != nullptr) {
-    instance->funcPtrs[instance->currFuncPtrId] = funcPteeName;
-    instance->currFuncPtrId.clear();
-    clang_disposeTokens(instance->getTU(), funcPtrTok, 1);
-    clang_disposeTokens(instance->getTU(), funcPteeTok, 1);
-    clang_disposeString(funcPtrStr);
-    clang_disposeString(funcPteeStr);
-    return CXChildVisit_Break;
+  CXCursor pointee = clang_getCursorReferenced(current);
+  unsigned funcId;
+  if (clang_Cursor_isNull(pointee) ||
+      clang_getCursorKind(pointee) != CXCursor_FunctionDecl ||
+      !instance->funcIdsByCursor.find(clang_getCanonicalCursor(pointee),
+                                      &funcId)) {
+    return CXChildVisit_Recurse;
   }
 
-  clang_disposeString(funcPtrStr);
-  clang_disposeString(funcPteeStr);
-  clang_disposeTokens(instance->getTU(), funcPtrTok, 1);
-  clang_disposeTokens(instance->getTU(), funcPteeTok, 1);
+  instance->funcPtrIdsByCursor.insert(clang_getCanonicalCursor(parent), funcId);
 
-  return CXChildVisit_Recurse;
+  // Names are kept for the cache and for watch sessions.
+  CXString funcPtrStr = clang_getCursorSpelling(parent);
+  instance->addFuncPtr(CXSTR(funcPtrStr), instance->funcsById[funcId]->name);
+  clang_disposeString(funcPtrStr);
+  return CXChildVisit_Break;
 }
 
 CXChildVisitResult KeyPointsCollector::VisitVarOrParamDecl(CXCursor current,
-                                                           CXCursor parent,
+                                                           CXCursor /*parent*/,
                                                            CXClientData kpc) {
   KeyPointsCollector *instance = static_cast<KeyPointsCollector *>(kpc);
 
@@ -350,16 +569,13 @@ CXChildVisitResult KeyPointsCollector::VisitVarOrParamDecl(CXCursor current,
     return CXChildVisit_Break;
   }
 
-  // Get token and its spelling
-  CXToken *varDeclToken = clang_getToken(instance->getTU(), varDeclLoc);
-  std::string varName =
-      CXSTR(clang_getTokenSpelling(instance->getTU(), *varDeclToken));
-
-  // Get reference to map for checking
-  std::map<std::string, unsigned> varMap = instance->getVarDecls();
+  // Get the declared name
+  CXString varNameStr = clang_getCursorSpelling(current);
+  std::string varName(CXSTR(varNameStr));
+  clang_disposeString(varNameStr);
 
   // Add to map of FuncDecls
-  if (varMap.find(varName) == varMap.end()) {
+  if (!(MAP_FIND(instance->varDecls, varName))) {
     if (instance->debug) {
       std::cout << "Found "
                 << (current.kind == CXCursor_VarDecl ? "VarDecl" : "ParamDecl")
@@ -368,11 +584,10 @@ CXChildVisitResult KeyPointsCollector::VisitVarOrParamDecl(CXCursor current,
     instance->addVarDeclToMap(varName, varDeclLineNum +
                                            instance->getNumIncludeDirectives());
   }
-  clang_disposeTokens(instance->getTU(), varDeclToken, 1);
   return CXChildVisit_Break;
 }
 
-CXChildVisitResult KeyPointsCollector::VisitFuncDecl(CXCursor current,
+CXChildVisitResult KeyPointsCollector::VisitFuncDecl(CXCursor /*current*/,
                                                      CXCursor parent,
                                                      CXClientData kpc) {
   KeyPointsCollector *instance = static_cast<KeyPointsCollector *>(kpc);
@@ -393,23 +608,26 @@ CXChildVisitResult KeyPointsCollector::VisitFuncDecl(CXCursor current,
                               nullptr, nullptr);
 
     // Get name
-    CXToken *funcDeclToken =
-        clang_getToken(instance->getTU(), clang_getCursorLocation(parent));
-    std::string funcName =
-        CXSTR(clang_getTokenSpelling(instance->getTU(), *funcDeclToken));
+    CXString funcNameStr = clang_getCursorSpelling(parent);
+    std::string funcName(CXSTR(funcNameStr));
+    clang_disposeString(funcNameStr);
 
-    // Add to map
-    instance->addFuncDecl(std::make_shared<FunctionDeclInfo>(
+    // Add to maps and intern by USR
+    std::shared_ptr<FunctionDeclInfo> decl = std::make_shared<FunctionDeclInfo>(
         begLineNum + instance->getNumIncludeDirectives(),
         endLineNum + instance->getNumIncludeDirectives(), funcName,
-        clang_getCString(funcReturnTypeSpelling)));
-    instance->currentFunction = instance->getFunctionByName(funcName);
+        clang_getCString(funcReturnTypeSpelling));
+    if (clang_isCursorDefinition(parent)) {
+      decl->setDefinition();
+    }
+    instance->addFuncDecl(decl);
+    instance->internFunction(parent, decl);
+    instance->currentFunction = decl;
     if (instance->debug) {
       std::cout << "Found FunctionDecl: " << funcName << " of return type: "
                 << clang_getCString(funcReturnTypeSpelling)
                 << " on line #: " << begLineNum << '\n';
     }
-    clang_disposeTokens(instance->getTU(), funcDeclToken, 1);
     clang_disposeString(funcReturnTypeSpelling);
   }
 
@@ -417,8 +635,417 @@ CXChildVisitResult KeyPointsCollector::VisitFuncDecl(CXCursor current,
 }
 
 void KeyPointsCollector::collectCursors() {
+  // Everything was restored from the cache already.
+  if (loadedFromCache) {
+    return;
+  }
+  std::chrono::steady_clock::time_point start =
+      std::chrono::steady_clock::now();
   clang_visitChildren(rootCursor, this->VisitorFunctionCore, this);
+  completePendingBranches();
   addBranchesToDictionary();
+  if (debug) {
+    std::cout << "Collected cursors in "
+              << std::chrono::duration_cast<std::chrono::microseconds>(
+                     std::chrono::steady_clock::now() - start)
+                     .count()
+              << " us\n";
+  }
+  if (options.useCache) {
+    saveCache();
+  }
+}
+
+std::string KeyPointsCollector::getSourceLines(unsigned first,
+                                               unsigned last) const {
+  size_t begin = 0;
+  unsigned lineNum = 1;
+  while (lineNum < first && begin != std::string::npos) {
+    begin = sourceBuffer.find('\n', begin);
+    if (begin != std::string::npos) {
+      ++begin;
+    }
+    ++lineNum;
+  }
+  if (begin == std::string::npos) {
+    return std::string();
+  }
+  size_t end = begin;
+  while (lineNum <= last && end != std::string::npos) {
+    end = sourceBuffer.find('\n', end);
+    if (end != std::string::npos) {
+      ++end;
+    }
+    ++lineNum;
+  }
+  return sourceBuffer.substr(begin, end == std::string::npos
+                                        ? std::string::npos
+                                        : end - begin);
+}
+
+void KeyPointsCollector::snapshotFunctions() {
+  functionSnapshots.clear();
+
+  // Ids are never handed out twice within a session.
+  nextBranchId = 1;
+  for (const auto &BP : branchDictionary) {
+    for (const BranchTarget &target : BP.second) {
+      nextBranchId = std::max(nextBranchId, target.id + 1);
+    }
+  }
+
+  for (const auto &func : funcDecls) {
+    const std::shared_ptr<FunctionDeclInfo> &decl = func.second;
+    FunctionSnapshot snapshot;
+    snapshot.textHash = hashString(getSourceLines(decl->defLoc, decl->endLoc));
+    snapshot.decl = decl;
+
+    for (auto BP = branchDictionary.lower_bound(decl->defLoc);
+         BP != branchDictionary.end() && BP->first <= decl->endLoc; ++BP) {
+      for (const BranchTarget &target : BP->second) {
+        snapshot.branches[BP->first - decl->defLoc]
+                         [target.targetLine - decl->defLoc] = target.id;
+      }
+    }
+    for (auto call = functionCalls.lower_bound(decl->defLoc);
+         call != functionCalls.end() && call->first <= decl->endLoc; ++call) {
+      snapshot.calls[call->first - decl->defLoc] = call->second;
+    }
+    for (const auto &var : varDecls) {
+      if (decl->isInBody(var.second)) {
+        snapshot.vars[var.first] = var.second - decl->defLoc;
+      }
+    }
+    functionSnapshots[decl->name] = snapshot;
+  }
+}
+
+void KeyPointsCollector::restoreFunction(FunctionSnapshot &snapshot,
+                                         unsigned defLoc) {
+  std::shared_ptr<FunctionDeclInfo> decl = snapshot.decl;
+  const unsigned length = decl->endLoc - decl->defLoc;
+  decl->defLoc = defLoc;
+  decl->endLoc = defLoc + length;
+  addFuncDecl(decl);
+  currentFunction = decl;
+
+  for (const auto &BP : snapshot.branches) {
+    std::vector<BranchTarget> &targets = branchDictionary[defLoc + BP.first];
+    for (const auto &target : BP.second) {
+      setTarget(targets, defLoc + target.first, target.second);
+    }
+  }
+  for (const auto &call : snapshot.calls) {
+    addCall(defLoc + call.first, call.second);
+  }
+  for (const auto &var : snapshot.vars) {
+    if (!(MAP_FIND(varDecls, var.first))) {
+      addVarDeclToMap(var.first, defLoc + var.second);
+    }
+  }
+  if (debug) {
+    std::cout << "Reused unchanged function: " << decl->name << " at line #: "
+              << defLoc << '\n';
+  }
+}
+
+void KeyPointsCollector::addChangedBranchesToDictionary(
+    const std::string &funcName) {
+  // Ids the function had before, handed out again in order.
+  std::vector<unsigned> reusableIds;
+  std::map<std::string, FunctionSnapshot>::iterator snapshot =
+      functionSnapshots.find(funcName);
+  if (snapshot != functionSnapshots.end()) {
+    for (const auto &BP : snapshot->second.branches) {
+      for (const auto &target : BP.second) {
+        reusableIds.push_back(target.second);
+      }
+    }
+    std::sort(reusableIds.begin(), reusableIds.end());
+  }
+
+  size_t nextReusable = 0;
+  for (std::vector<BranchPointInfo>::reverse_iterator branchPoint =
+           branchPoints.rbegin();
+       branchPoint != branchPoints.rend(); branchPoint++) {
+    std::vector<BranchTarget> targetsAndIds;
+    for (const unsigned &target : branchPoint->targetLineNumbers) {
+      const unsigned id = nextReusable < reusableIds.size()
+                              ? reusableIds[nextReusable++]
+                              : nextBranchId++;
+      setTarget(targetsAndIds, target, id);
+    }
+    branchDictionary[branchPoint->branchPoint] = std::move(targetsAndIds);
+  }
+  branchPoints.clear();
+}
+
+CXChildVisitResult KeyPointsCollector::VisitTopLevelIncremental(
+    CXCursor current, CXCursor parent, CXClientData kpc) {
+  KeyPointsCollector *instance = static_cast<KeyPointsCollector *>(kpc);
+  if (!clang_Location_isFromMainFile(clang_getCursorLocation(current))) {
+    return CXChildVisit_Continue;
+  }
+
+  std::string funcName;
+  if (clang_getCursorKind(current) == CXCursor_FunctionDecl) {
+    // Compare the functions source against its snapshot.
+    unsigned begLineNum, endLineNum;
+    CXSourceRange funcRange = clang_getCursorExtent(current);
+    clang_getSpellingLocation(clang_getRangeStart(funcRange),
+                              instance->getCXFile(), &begLineNum, nullptr,
+                              nullptr);
+    clang_getSpellingLocation(clang_getRangeEnd(funcRange),
+                              instance->getCXFile(), &endLineNum, nullptr,
+                              nullptr);
+    begLineNum += instance->getNumIncludeDirectives();
+    endLineNum += instance->getNumIncludeDirectives();
+
+    CXString funcNameStr = clang_getCursorSpelling(current);
+    funcName = CXSTR(funcNameStr);
+    clang_disposeString(funcNameStr);
+
+    std::map<std::string, FunctionSnapshot>::iterator snapshot =
+        instance->functionSnapshots.find(funcName);
+    if (snapshot != instance->functionSnapshots.end() &&
+        snapshot->second.textHash ==
+            hashString(instance->getSourceLines(begLineNum, endLineNum))) {
+      instance->restoreFunction(snapshot->second, begLineNum);
+      instance->internFunction(current, snapshot->second.decl);
+      return CXChildVisit_Continue;
+    }
+  }
+
+  // Changed or new, walk it as the full traversal would.
+  if (VisitorFunctionCore(current, parent, kpc) == CXChildVisit_Recurse) {
+    clang_visitChildren(current, &KeyPointsCollector::VisitorFunctionCore, kpc);
+  }
+  instance->completePendingBranches();
+  instance->addChangedBranchesToDictionary(funcName);
+  return CXChildVisit_Continue;
+}
+
+bool KeyPointsCollector::reanalyze() {
+  // Snapshot against the source the current analysis was made from.
+  snapshotFunctions();
+  const std::string previousSource(sourceBuffer);
+
+  sourceBuffer.clear();
+  parseBuffer.clear();
+  includeDirectives.clear();
+  originalBuilt = false;
+  loadSource();
+  if (sourceBuffer == previousSource) {
+    return false;
+  }
+  if (options.keepIncludes) {
+    parseBuffer = sourceBuffer;
+  } else {
+    removeIncludeDirectives();
+  }
+
+  // Reparse in place when a TU is alive, reusing its preamble. A failed
+  // reparse leaves the TU unusable, so fall back to a fresh parse.
+  bool reparsed = false;
+  if (translationUnit != nullptr) {
+    CXUnsavedFile unsavedFile = {
+        filename.c_str(), parseBuffer.c_str(),
+        static_cast<unsigned long>(parseBuffer.size())};
+    reparsed = clang_reparseTranslationUnit(
+                   translationUnit, 1, &unsavedFile,
+                   clang_defaultReparseOptions(translationUnit)) == 0;
+    if (!reparsed) {
+      clang_disposeTranslationUnit(translationUnit);
+      translationUnit = nullptr;
+    }
+  }
+  if (!reparsed) {
+    parseTranslationUnit();
+    if (translationUnit == nullptr) {
+      std::cerr << "There was an error parsing the translation unit!\n";
+      return false;
+    }
+  }
+  rootCursor = clang_getTranslationUnitCursor(translationUnit);
+  cxFile = clang_getFile(translationUnit, filename.c_str());
+
+  // Start from a clean slate, function pointers are kept as they are only
+  // found by walking the functions declaring them.
+  cursorObjs.clear();
+  funcDecls.clear();
+  funcDeclsString.clear();
+  functionCalls.clear();
+  varDecls.clear();
+  branchDictionary.clear();
+  branchPoints.clear();
+  currentFunction = nullptr;
+  funcIdsByCursor.clear();
+  funcPtrIdsByCursor.clear();
+
+  clang_visitChildren(rootCursor, &KeyPointsCollector::VisitTopLevelIncremental,
+                      this);
+
+  branchCount = 0;
+  for (const auto &BP : branchDictionary) {
+    branchCount += BP.second.size();
+  }
+  loadedFromCache = false;
+  if (options.useCache) {
+    saveCache();
+  }
+  return true;
+}
+
+uint64_t KeyPointsCollector::getCacheKey() const {
+  uint64_t key = hashString(sourceBuffer);
+  for (const std::string &arg : compilerArgs) {
+    key = hashString(arg, key);
+  }
+  return hashString(options.keepIncludes ? "keep-includes" : "strip-includes",
+                    key);
+}
+
+bool KeyPointsCollector::loadCache() {
+  CacheReader cache(getCacheFilename());
+  if (!cache.good() || cache.readU32() != ANALYSIS_CACHE_MAGIC ||
+      cache.readU32() != ANALYSIS_CACHE_VERSION ||
+      cache.readU64() != getCacheKey()) {
+    return false;
+  }
+
+  // Function definitions
+  const uint32_t numFuncs = cache.readU32();
+  for (uint32_t idx = 0; idx < numFuncs && cache.good(); ++idx) {
+    const unsigned defLoc = cache.readU32();
+    const unsigned endLoc = cache.readU32();
+    const std::string name = cache.readString();
+    const std::string type = cache.readString();
+    std::shared_ptr<FunctionDeclInfo> decl =
+        std::make_shared<FunctionDeclInfo>(defLoc, endLoc, name, type);
+    if (cache.readU32()) {
+      decl->setRecursive();
+    }
+    if (cache.readU32()) {
+      decl->setDefinition();
+    }
+    // No USRs without a parse, in C a name identifies the function just the
+    // same.
+    std::shared_ptr<FunctionDeclInfo> interned = getFunctionByName(name);
+    if (interned != nullptr) {
+      decl->id = interned->id;
+    } else {
+      decl->id = funcsById.size();
+      funcsById.push_back(nullptr);
+    }
+    funcsById[decl->id] = decl;
+    addFuncDecl(decl);
+  }
+
+  // Function calls
+  const uint32_t numCalls = cache.readU32();
+  for (uint32_t idx = 0; idx < numCalls && cache.good(); ++idx) {
+    const unsigned lineNum = cache.readU32();
+    addCall(lineNum, cache.readString());
+  }
+
+  // Function pointers
+  const uint32_t numPtrs = cache.readU32();
+  for (uint32_t idx = 0; idx < numPtrs && cache.good(); ++idx) {
+    const std::string id = cache.readString();
+    addFuncPtr(id, cache.readString());
+  }
+
+  // Variable declarations
+  const uint32_t numVars = cache.readU32();
+  for (uint32_t idx = 0; idx < numVars && cache.good(); ++idx) {
+    const std::string name = cache.readString();
+    addVarDeclToMap(name, cache.readU32());
+  }
+
+  // Branch dictionary
+  const uint32_t numBranchPoints = cache.readU32();
+  for (uint32_t idx = 0; idx < numBranchPoints && cache.good(); ++idx) {
+    const unsigned branchPoint = cache.readU32();
+    const uint32_t numTargets = cache.readU32();
+    for (uint32_t target = 0; target < numTargets && cache.good(); ++target) {
+      const unsigned targetLineNum = cache.readU32();
+      branchDictionary[branchPoint].emplace_back(targetLineNum,
+                                                 cache.readU32());
+      ++branchCount;
+    }
+  }
+
+  // Anything short or corrupt, start over with a full analysis.
+  if (!cache.good()) {
+    funcDecls.clear();
+    funcDeclsString.clear();
+    funcsById.clear();
+    functionCalls.clear();
+    funcPtrs.clear();
+    varDecls.clear();
+    branchDictionary.clear();
+    branchCount = 0;
+    return false;
+  }
+  return true;
+}
+
+void KeyPointsCollector::saveCache() {
+  // Write to a unique name and rename, so a reader never sees a partial file.
+  std::stringstream tempName;
+  tempName << getCacheFilename() << '.' << this;
+  {
+    CacheWriter cache(tempName.str());
+    if (!cache.good()) {
+      return;
+    }
+    cache.writeU32(ANALYSIS_CACHE_MAGIC);
+    cache.writeU32(ANALYSIS_CACHE_VERSION);
+    cache.writeU64(getCacheKey());
+
+    cache.writeU32(funcDecls.size());
+    for (const auto &func : funcDecls) {
+      cache.writeU32(func.second->defLoc);
+      cache.writeU32(func.second->endLoc);
+      cache.writeString(func.second->name);
+      cache.writeString(func.second->type);
+      cache.writeU32(func.second->recursive);
+      cache.writeU32(func.second->definition);
+    }
+
+    cache.writeU32(functionCalls.size());
+    for (const auto &call : functionCalls) {
+      cache.writeU32(call.first);
+      cache.writeString(call.second);
+    }
+
+    cache.writeU32(funcPtrs.size());
+    for (const auto &ptr : funcPtrs) {
+      cache.writeString(ptr.first);
+      cache.writeString(ptr.second);
+    }
+
+    cache.writeU32(varDecls.size());
+    for (const auto &var : varDecls) {
+      cache.writeString(var.first);
+      cache.writeU32(var.second);
+    }
+
+    cache.writeU32(branchDictionary.size());
+    for (const auto &BP : branchDictionary) {
+      cache.writeU32(BP.first);
+      cache.writeU32(BP.second.size());
+      for (const BranchTarget &target : BP.second) {
+        cache.writeU32(target.targetLine);
+        cache.writeU32(target.id);
+      }
+    }
+    if (!cache.good()) {
+      std::remove(tempName.str().c_str());
+      return;
+    }
+  }
+  std::rename(tempName.str().c_str(), getCacheFilename().c_str());
 }
 
 void KeyPointsCollector::printFoundBranchPoint(const CXCursorKind K) {
@@ -443,22 +1070,51 @@ void KeyPointsCollector::createDictionaryFile() {
   dictFile << "Branch Dictionary for: " << filename << '\n';
   dictFile << "-----------------------" << std::string(filename.size(), '-')
            << '\n';
+  writeBranchDictionary(dictFile);
 
-  // Get branch dict ref
-  const std::map<unsigned, std::map<unsigned, std::string>> &branchDict =
-      getBranchDictionary();
+  // Close file
+  dictFile.close();
+}
 
+void KeyPointsCollector::writeBranchDictionary(std::ostream &out,
+                                               bool qualifyIds) {
   // Iterate over branch poitns and their targets
-  for (const std::pair<unsigned, std::map<unsigned, std::string>> &BP :
-       branchDict) {
-    for (const std::pair<unsigned, std::string> &targets : BP.second) {
-      dictFile << targets.second << ": " << filename << ", " << BP.first << ", "
-               << targets.first << '\n';
+  for (const auto &BP : getBranchDictionary()) {
+    for (const BranchTarget &target : BP.second) {
+      if (qualifyIds) {
+        out << filename << ':';
+      }
+      out << BRANCH_ID(target.id) << ": " << filename << ", " << BP.first
+          << ", " << target.targetLine;
+      // The edge's index in the coverage map.
+      if (options.traceFormat == TraceFormat::Coverage) {
+        out << ", edge " << target.id;
+      }
+      out << '\n';
     }
   }
+}
 
-  // Close file
-  dictFile.close();
+const KeyPointsCollector::BranchTarget *
+KeyPointsCollector::findTarget(const std::vector<BranchTarget> &targets,
+                               unsigned lineNum) {
+  std::vector<BranchTarget>::const_iterator target = std::lower_bound(
+      targets.begin(), targets.end(), lineNum,
+      [](const BranchTarget &T, unsigned L) { return T.targetLine < L; });
+  return target != targets.end() && target->targetLine == lineNum ? &*target
+                                                                  : nullptr;
+}
+
+void KeyPointsCollector::setTarget(std::vector<BranchTarget> &targets,
+                                   unsigned lineNum, unsigned id) {
+  std::vector<BranchTarget>::iterator target = std::lower_bound(
+      targets.begin(), targets.end(), lineNum,
+      [](const BranchTarget &T, unsigned L) { return T.targetLine < L; });
+  if (target != targets.end() && target->targetLine == lineNum) {
+    target->id = id;
+  } else {
+    targets.emplace(target, lineNum, id);
+  }
 }
 
 void KeyPointsCollector::addCompletedBranch() {
@@ -466,73 +1122,140 @@ void KeyPointsCollector::addCompletedBranch() {
   branchPointStack.pop();
 }
 
+void KeyPointsCollector::completePendingBranches() {
+  while (compoundStmtFoundYet()) {
+    addCompletedBranch();
+  }
+}
+
 void KeyPointsCollector::addBranchesToDictionary() {
+  // Ids are handed out in reverse completion order, gather the entries first
+  // and insert them sorted so every insert is an append.
+  std::vector<std::pair<unsigned, std::vector<BranchTarget>>> entries;
+  entries.reserve(branchPoints.size());
   for (std::vector<BranchPointInfo>::reverse_iterator branchPoint =
            branchPoints.rbegin();
        branchPoint != branchPoints.rend(); branchPoint++) {
-    std::map<unsigned, std::string> targetsAndIds;
+    std::vector<BranchTarget> targetsAndIds;
+    targetsAndIds.reserve(branchPoint->targetLineNumbers.size());
     for (const unsigned &target : branchPoint->targetLineNumbers) {
-      targetsAndIds[target] = "br_" + std::to_string(++branchCount);
+      setTarget(targetsAndIds, target, ++branchCount);
     }
-    branchDictionary[branchPoint->branchPoint] = targetsAndIds;
+    entries.emplace_back(branchPoint->branchPoint, std::move(targetsAndIds));
+  }
+  // Stable, so for two branch points on one line the last one wins as before.
+  std::stable_sort(entries.begin(), entries.end(),
+                   [](const std::pair<unsigned, std::vector<BranchTarget>> &A,
+                      const std::pair<unsigned, std::vector<BranchTarget>> &B) {
+                     return A.first < B.first;
+                   });
+  branchDictionary.reserve(entries.size());
+  for (std::pair<unsigned, std::vector<BranchTarget>> &entry : entries) {
+    branchDictionary[entry.first] = std::move(entry.second);
   }
 }
 
-void KeyPointsCollector::transformProgram() {
-  // First, open original file for reading, and modified file for writing.
-  std::ifstream originalProgram(filename);
+bool KeyPointsCollector::transformProgram() {
+  std::chrono::steady_clock::time_point start =
+      std::chrono::steady_clock::now();
+
+  // Open the modified file for writing, the original program is read straight
+  // from the in memory source.
   std::ofstream modifiedProgram(MODIFIED_PROGAM_OUT);
 
-  // Check files opened successfully
-  if (originalProgram.good() && modifiedProgram.good()) {
+  // Check file opened successfully
+  if (modifiedProgram.good()) {
     // First write the header to the output file
-    modifiedProgram << TRANSFORM_HEADER;
+    writeTransformHeader(modifiedProgram);
 
     // Keep track of line numbers
     unsigned lineNum = 1;
 
-    // Containers for current line and new lines
-    std::string currentLine;
-
     // Current function being analyzed
     std::shared_ptr<FunctionDeclInfo> currentTransformFunction = nullptr;
 
     // Amount of branches within current function.
-    int branchCountCurrFunc;
+    unsigned branchCountCurrFunc = 0;
 
-    // Get ref to function decls
-    std::map<unsigned, std::shared_ptr<FunctionDeclInfo>> funcDecls =
+    // Everything the transform needs is sorted by line, so walk each list with
+    // its own cursor alongside the source instead of looking lines up.
+    const FlatLineMap<std::shared_ptr<FunctionDeclInfo>> &funcDecls =
         getFuncDecls();
-
-    // Get Ref to function calls.
-    std::map<unsigned, std::string> funcCalls = getFuncCalls();
-
-    // Get ref to branch dictionary
-    std::map<unsigned, std::map<unsigned, std::string>> branchDict =
+    const FlatLineMap<std::string> &funcCalls = getFuncCalls();
+    const FlatLineMap<std::vector<BranchTarget>> &branchDict =
         getBranchDictionary();
-
-    // Keep track of line branch point line numbers that have been encountered.
-    std::vector<unsigned> foundPoints;
+    FlatLineMap<std::shared_ptr<FunctionDeclInfo>>::const_iterator nextFunc =
+        funcDecls.begin();
+    FlatLineMap<std::string>::const_iterator nextCall = funcCalls.begin();
+    FlatLineMap<std::vector<BranchTarget>>::const_iterator nextPoint =
+        branchDict.begin();
+
+    // Branch points are numbered by their position in the dictionary. Points
+    // found since the start of the current function are the ones numbered
+    // [funcFirstPoint, foundPointsEnd), a point's index among them is what
+    // BRANCH_X refers to in the transformed program.
+    unsigned funcFirstPoint = 0;
+    unsigned foundPointsEnd = 0;
+
+    // Every target of every branch point, sorted by target line.
+    std::vector<TargetEvent> targetEvents = getTargetEvents();
+
+    // Branch flags that are tested somewhere, only those are declared and set.
+    const std::vector<bool> testedFlags = getTestedBranchFlags(targetEvents);
+    std::vector<TargetEvent>::const_iterator nextTarget = targetEvents.begin();
+
+    // Targets on the current line whose branch point has been found, by
+    // descending found index. Reused for every line.
+    struct FoundTarget {
+      unsigned foundIdx;
+      unsigned id;
+    };
+    std::vector<FoundTarget> foundTargetsCurrentLine;
 
     // Core iteration over original program
-    while (getline(originalProgram, currentLine)) {
+    std::string_view source(sourceBuffer);
+    size_t lineStart = 0;
+    while (lineStart < source.size()) {
+      size_t lineEnd = source.find('\n', lineStart);
+      if (lineEnd == std::string_view::npos) {
+        lineEnd = source.size();
+      }
+      const std::string_view currentLine =
+          source.substr(lineStart, lineEnd - lineStart);
+      lineStart = lineEnd + 1;
+
       // If previous line is a function def/decl, insert the branch points for
       // that function and set current function.
-      if (MAP_FIND(funcDecls, lineNum - 1)) {
-        currentTransformFunction = funcDecls[lineNum - 1];
+      while (nextFunc != funcDecls.end() && nextFunc->first < lineNum - 1) {
+        ++nextFunc;
+      }
+      if (nextFunc != funcDecls.end() && nextFunc->first == lineNum - 1) {
+        currentTransformFunction = nextFunc->second;
+
+        // Switch the inserted statements of this function on or off.
+        modifiedProgram
+            << FUNCTION_TRACE_SWITCH(currentTransformFunction->name);
 
         // Declare a pointer to the current function within the function scope
         // to handle recursive calls.
         if (currentTransformFunction->name.compare("main") &&
             currentTransformFunction->recursive &&
             currentTransformFunction->type != "void") {
-          modifiedProgram << DECLARE_FUNC_PTR(currentTransformFunction);
+          modifiedProgram << DECLARE_FUNC_PTR("KPC_LOCAL",
+                                              currentTransformFunction);
         }
 
-        foundPoints.clear();
+        funcFirstPoint = foundPointsEnd;
         branchCountCurrFunc = 0;
-        insertFunctionBranchPointDecls(
-            modifiedProgram, currentTransformFunction, &branchCountCurrFunc);
+        // Prototypes have no body to declare flags in or to time.
+        if (currentTransformFunction->definition) {
+          insertFunctionBranchPointDecls(modifiedProgram,
+                                         currentTransformFunction,
+                                         &branchCountCurrFunc, testedFlags);
+          if (options.profile) {
+            modifiedProgram << PROFILE_FUNCTION(currentTransformFunction->id);
+          }
+        }
       }
 
       // If we have a current function AND the previous line is the end of said
@@ -541,39 +1264,47 @@ void KeyPointsCollector::transformProgram() {
       if (currentTransformFunction != nullptr &&
           (lineNum - 1) == currentTransformFunction->endLoc &&
           currentTransformFunction->name.compare("main")) {
-        modifiedProgram << DECLARE_FUNC_PTR(currentTransformFunction);
+        modifiedProgram << DECLARE_FUNC_PTR("KPC_GLOBAL",
+                                            currentTransformFunction);
       }
 
       // If the previous line was a branch point, set the branch
-      if (MAP_FIND(branchDict, lineNum - 1)) {
-        modifiedProgram << SET_BRANCH(foundPoints.size());
-        foundPoints.push_back(lineNum - 1);
+      while (nextPoint != branchDict.end() && nextPoint->first < lineNum - 1) {
+        ++nextPoint;
+        ++foundPointsEnd;
+      }
+      if (nextPoint != branchDict.end() && nextPoint->first == lineNum - 1) {
+        if (testedFlags[foundPointsEnd]) {
+          modifiedProgram << SET_BRANCH(foundPointsEnd - funcFirstPoint);
+        }
+        modifiedProgram << SET_BRANCH_MAX(foundPointsEnd - funcFirstPoint);
+        ++nextPoint;
+        ++foundPointsEnd;
       }
 
-      // Iterate over found branch points and look for targets
-
-      // This vector holds not the location of the branch point, but the INDEX
-      // of the branches location in the foundPoints vector above. This is done
-      // as the index is how we access BRANCH_X in the transformed program.
-      std::vector<unsigned> foundPointsIdxCurrentLine;
-
-      if (!foundPoints.empty()) {
-        for (int idx = foundPoints.size() - 1; idx >= 0; --idx) {
-          // Get targets for BP
-          std::map<unsigned, std::string> targets =
-              branchDict[foundPoints[idx]];
-
-          // If target exists for any branch point, add to list for the current
-          // line number.
-          if (MAP_FIND(targets, lineNum)) {
-            foundPointsIdxCurrentLine.push_back(idx);
-          }
+      // Collect the targets on this line of branch points found in the current
+      // function. This holds not the location of the branch point, but its
+      // found index, as the index is how we access BRANCH_X in the transformed
+      // program.
+      foundTargetsCurrentLine.clear();
+      while (nextTarget != targetEvents.end() && nextTarget->line < lineNum) {
+        ++nextTarget;
+      }
+      for (; nextTarget != targetEvents.end() && nextTarget->line == lineNum;
+           ++nextTarget) {
+        if (nextTarget->point >= funcFirstPoint &&
+            nextTarget->point < foundPointsEnd) {
+          foundTargetsCurrentLine.push_back(
+              {nextTarget->point - funcFirstPoint, nextTarget->id});
         }
       }
 
       // After targets are found, insert proper logging logic into modified
       // program.
-      switch (foundPointsIdxCurrentLine.size()) {
+      if (!foundTargetsCurrentLine.empty()) {
+        modifiedProgram << "KPC_LOCAL(";
+      }
+      switch (foundTargetsCurrentLine.size()) {
         // None? Get outta there.
       case 0:
         break;
@@ -581,41 +1312,29 @@ void KeyPointsCollector::transformProgram() {
       // successive branch points have NOT been set, this prevents unecessary
       // logging after the exit of something like an if block. e.g if the
       // target is from BRANCH_0,  ensure that BRANCH_1...BRANCH_N arent set =
-      // 1;
+      // 1; Flags are never cleared, so that is the highest entered branch
+      // BRANCH_MAX being at most 0, a single test.
       case 1: {
         // If branch actually has successive points, then construct a
         // conditional.
-        if (foundPointsIdxCurrentLine[0] + 1 < branchCountCurrFunc) {
-          modifiedProgram << "if (";
-          for (int successive = foundPointsIdxCurrentLine[0] + 1;
-               successive < branchCountCurrFunc; successive++) {
-            modifiedProgram << "!BRANCH_" << successive;
-            if (branchCountCurrFunc - successive > 1)
-              modifiedProgram << " && ";
-          }
-          modifiedProgram
-              << ") LOG(\""
-              << branchDict[foundPoints[foundPointsIdxCurrentLine[0]]][lineNum]
-              << "\");";
+        if (foundTargetsCurrentLine[0].foundIdx + 1 < branchCountCurrFunc) {
+          modifiedProgram << "if (BRANCH_MAX <= "
+                          << foundTargetsCurrentLine[0].foundIdx << ") "
+                          << logBranch(foundTargetsCurrentLine[0].id) << ";";
         }
         // If not, just log it.
         else {
-          modifiedProgram
-              << "LOG(\""
-              << branchDict[foundPoints[foundPointsIdxCurrentLine[0]]][lineNum]
-              << "\");";
+          modifiedProgram << logBranch(foundTargetsCurrentLine[0].id) << ";";
         }
         break;
       }
       // If two targets for the current line number, we can insert a simple if
       // else block
       case 2: {
-        modifiedProgram
-            << "if (BRANCH_" << foundPointsIdxCurrentLine[0] << ") {LOG(\""
-            << branchDict[foundPoints[foundPointsIdxCurrentLine[0]]][lineNum]
-            << "\")} else {LOG(\""
-            << branchDict[foundPoints[foundPointsIdxCurrentLine[1]]][lineNum]
-            << "\")}";
+        modifiedProgram << "if (BRANCH_" << foundTargetsCurrentLine[0].foundIdx
+                        << ") {" << logBranch(foundTargetsCurrentLine[0].id)
+                        << "} else {"
+                        << logBranch(foundTargetsCurrentLine[1].id) << "}";
         break;
       }
       // Default is more than 2, in this case, we need to insert a proper if,
@@ -623,39 +1342,56 @@ void KeyPointsCollector::transformProgram() {
       // line number.
       default: {
         // Insert initial if block
-        modifiedProgram
-            << "if (BRANCH_" << foundPointsIdxCurrentLine[0] << ") {LOG(\""
-            << branchDict[foundPoints[foundPointsIdxCurrentLine[0]]][lineNum]
-            << "\")}";
+        modifiedProgram << "if (BRANCH_" << foundTargetsCurrentLine[0].foundIdx
+                        << ") {" << logBranch(foundTargetsCurrentLine[0].id)
+                        << "}";
 
         // Insert else if blocks for all branches before the last.
-        for (int successive = 1;
-             successive < foundPointsIdxCurrentLine.size() - 1; successive++) {
+        for (size_t successive = 1;
+             successive < foundTargetsCurrentLine.size() - 1; successive++) {
           modifiedProgram
-              << " else if (BRANCH_" << foundPointsIdxCurrentLine[successive]
-              << ") {LOG(\""
-              << branchDict[foundPoints[foundPointsIdxCurrentLine[successive]]]
-                           [lineNum]
-              << "\")}";
+              << " else if (BRANCH_"
+              << foundTargetsCurrentLine[successive].foundIdx << ") {"
+              << logBranch(foundTargetsCurrentLine[successive].id) << "}";
         }
 
         // Insert final else for the last branch point.
-        modifiedProgram
-            << "else {LOG(\""
-            << branchDict[foundPoints[foundPointsIdxCurrentLine
-                                          [foundPointsIdxCurrentLine.size() -
-                                           1]]][lineNum]
-            << "\")}";
+        modifiedProgram << "else {"
+                        << logBranch(foundTargetsCurrentLine.back().id) << "}";
 
       } break;
       }
+      if (!foundTargetsCurrentLine.empty()) {
+        modifiedProgram << ")";
+      }
 
       // Check to see if we encountered a call expr last. If branch target and
       // call on the same line, it seems more intuitive for the branch log to
       // come before the function log. e.g br_here THEN call func_0x1010101010.
-      if (MAP_FIND(funcCalls, lineNum)) {
-        modifiedProgram << "LOG_PTR(" << funcCalls[lineNum] << "_PTR"
-                        << ");\n";
+      while (nextCall != funcCalls.end() && nextCall->first < lineNum) {
+        ++nextCall;
+      }
+      // A watch session keeps the calls of unchanged functions, and an edit
+      // may have removed the function they call. Without it there is no id
+      // and no pointer to log, so leave the call out of the trace.
+      std::shared_ptr<FunctionDeclInfo> callee;
+      if (nextCall != funcCalls.end() && nextCall->first == lineNum) {
+        callee = getFunctionByName(nextCall->second);
+        if (callee == nullptr) {
+          std::cerr << "No declaration of " << nextCall->second
+                    << " found for the call on line " << lineNum
+                    << ", it will not be traced.\n";
+        }
+      }
+      if (callee != nullptr) {
+        if (options.traceFormat != TraceFormat::Text) {
+          modifiedProgram << "KPC_LOCAL(LOG_FUNC(" << callee->id << ", "
+                          << nextCall->second << "_PTR"
+                          << ");)\n";
+        } else {
+          modifiedProgram << "KPC_LOCAL(LOG_PTR(" << nextCall->second << "_PTR"
+                          << ");)\n";
+        }
       }
 
       // Write line
@@ -663,163 +1399,798 @@ void KeyPointsCollector::transformProgram() {
       lineNum++;
     }
 
-    // Close files
-    originalProgram.close();
+    // kpc's entry point, after main.
+    if (options.inProcess) {
+      modifiedProgram << IN_PROCESS_MAIN;
+    }
+
+    // Close file
     modifiedProgram.close();
 
+    if (debug) {
+      std::cout << "Transformed " << lineNum - 1 << " lines in "
+                << std::chrono::duration_cast<std::chrono::microseconds>(
+                       std::chrono::steady_clock::now() - start)
+                       .count()
+                << "us\n";
+    }
+    return true;
+  }
+  std::cerr << "Error opening " << MODIFIED_PROGAM_OUT
+            << " for transformation!\n";
+  return false;
+}
+
+std::vector<KeyPointsCollector::TargetEvent>
+KeyPointsCollector::getTargetEvents() const {
+  std::vector<TargetEvent> events;
+  unsigned point = 0;
+  for (const std::pair<unsigned, std::vector<BranchTarget>> &BP :
+       branchDictionary) {
+    for (const BranchTarget &target : BP.second) {
+      events.push_back({target.targetLine, point, target.id});
+    }
+    ++point;
+  }
+  // Within a line, latest found branch point first.
+  std::sort(events.begin(), events.end(),
+            [](const TargetEvent &A, const TargetEvent &B) {
+              return A.line < B.line || (A.line == B.line && A.point > B.point);
+            });
+  return events;
+}
+
+unsigned KeyPointsCollector::getMaxBranchId() const {
+  unsigned maxBranchId = 0;
+  for (const std::pair<unsigned, std::vector<BranchTarget>> &BP :
+       branchDictionary) {
+    for (const BranchTarget &target : BP.second) {
+      maxBranchId = std::max(maxBranchId, target.id);
+    }
+  }
+  return maxBranchId;
+}
+
+void KeyPointsCollector::writeTransformHeader(std::ofstream &program) {
+  // Nothing of the runtime is compiled in without KPC_TRACE.
+  program << TRACE_SWITCH_HEADER << "#ifdef KPC_TRACE\n";
+
+  // Per branch and per function arrays are sized by the largest branch id,
+  // ids are not necessarily dense after a watch session.
+  const bool sampled = options.binaryTrace() && options.samplePeriod != 0;
+  if (options.traceFormat == TraceFormat::Counters ||
+      options.traceFormat == TraceFormat::Coverage || sampled ||
+      options.profile) {
+    program << "#define KPC_BRANCHES " << getMaxBranchId() + 1 << "\n"
+            << "#define KPC_FUNCS " << std::max<size_t>(funcsById.size(), 1)
+            << "\n";
+  }
+  if (sampled) {
+    program << "#define KPC_SAMPLE_WARMUP " << options.sampleWarmup << "u\n"
+            << "#define KPC_SAMPLE_PERIOD " << options.samplePeriod << "u\n";
+  }
+
+  // Function names for the counts and the profile.
+  if (options.traceFormat == TraceFormat::Counters || options.profile) {
+    program << "static const char *const kpc_func_names[KPC_FUNCS] = {";
+    for (const std::shared_ptr<FunctionDeclInfo> &func : funcsById) {
+      program << "\"" << (func != nullptr ? func->name : "") << "\", ";
+    }
+    program << "};\n";
+  }
+
+  if (options.inProcess) {
+    program << "#define KPC_TRACE_BRANCH " << TRACE_BRANCH << "u\n"
+            << "#define KPC_TRACE_FUNC " << TRACE_FUNC << "u\n"
+            << IN_PROCESS_RUNTIME;
+  } else if (options.binaryTrace()) {
+    const bool threaded = options.traceFormat == TraceFormat::Threaded;
+    program << "#define KPC_TRACE_MAGIC "
+            << (threaded ? THREADED_TRACE_MAGIC : TRACE_MAGIC) << "u\n"
+            << "#define KPC_TRACE_VERSION "
+            << (threaded ? THREADED_TRACE_VERSION : TRACE_VERSION) << "u\n"
+            << "#define KPC_TRACE_BRANCH " << TRACE_BRANCH << "u\n"
+            << "#define KPC_TRACE_FUNC " << TRACE_FUNC << "u\n"
+            << "#define KPC_TRACE_REPEAT " << TRACE_REPEAT << "u\n"
+            << "#define KPC_TRACE_SAMPLING " << TRACE_SAMPLING << "u\n"
+            << "#define KPC_TRACE_MAX_PERIOD " << TRACE_MAX_PERIOD << "u\n"
+            << "#define KPC_TRACE_HISTORY " << TRACE_HISTORY << "u\n"
+            << "#define KPC_TRACE_DEFAULT \"" << TRACE_OUT << "\"\n"
+            << (threaded ? THREADED_RUNTIME : TRACE_RUNTIME);
+    if (sampled) {
+      program << SAMPLING_RUNTIME;
+    }
+  } else if (options.traceFormat == TraceFormat::Counters) {
+    program << "#define KPC_TRACE_DEFAULT \"" << COUNTS_OUT << "\"\n"
+            << COUNTER_RUNTIME;
+  } else if (options.traceFormat == TraceFormat::Coverage) {
+    program << "#define KPC_COVERAGE_MAGIC " << COVERAGE_MAGIC << "u\n"
+            << "#define KPC_COVERAGE_VERSION " << COVERAGE_VERSION << "u\n"
+            << "#define KPC_TRACE_DEFAULT \"" << COVERAGE_OUT << "\"\n"
+            << COVERAGE_RUNTIME;
   } else {
-    std::cerr << "Error opening program files for transformation!\n";
-    exit(EXIT_FAILURE);
+    program << TRANSFORM_HEADER;
   }
+
+  if (options.profile) {
+    program << "#define KPC_PROFILE_DEFAULT \"" << PROFILE_OUT << "\"\n";
+    if (options.traceFormat == TraceFormat::Threaded) {
+      program << "#define KPC_PROFILE_ATOMIC\n";
+    }
+    program << PROFILE_RUNTIME;
+  }
+  program << "#endif\n";
+}
+
+std::vector<bool> KeyPointsCollector::getTestedBranchFlags(
+    const std::vector<TargetEvent> &targetEvents) const {
+  // Mirrors how transformProgram() tracks entered branch points: at a target
+  // line, those from the last function started before it up to the line.
+  std::vector<bool> tested(branchDictionary.size(), false);
+  FlatLineMap<std::shared_ptr<FunctionDeclInfo>>::const_iterator nextFunc =
+      funcDecls.begin();
+  unsigned funcFirstPoint = 0;
+  std::vector<TargetEvent>::const_iterator lineTargets = targetEvents.begin();
+  while (lineTargets != targetEvents.end()) {
+    const unsigned lineNum = lineTargets->line;
+    while (nextFunc != funcDecls.end() && nextFunc->first < lineNum) {
+      funcFirstPoint = branchDictionary.lower_bound(nextFunc->first) -
+                       branchDictionary.begin();
+      ++nextFunc;
+    }
+    const unsigned foundPointsEnd =
+        branchDictionary.lower_bound(lineNum) - branchDictionary.begin();
+
+    std::vector<TargetEvent>::const_iterator lineEnd = lineTargets;
+    unsigned found = 0;
+    for (; lineEnd != targetEvents.end() && lineEnd->line == lineNum;
+         ++lineEnd) {
+      found +=
+          lineEnd->point >= funcFirstPoint && lineEnd->point < foundPointsEnd;
+    }
+    if (found > 1) {
+      for (; lineTargets != lineEnd; ++lineTargets) {
+        if (lineTargets->point >= funcFirstPoint &&
+            lineTargets->point < foundPointsEnd) {
+          tested[lineTargets->point] = true;
+        }
+      }
+    }
+    lineTargets = lineEnd;
+  }
+  return tested;
 }
 
 void KeyPointsCollector::insertFunctionBranchPointDecls(
     std::ofstream &program, std::shared_ptr<FunctionDeclInfo> function,
-    int *branchCount) {
-  // Iterate over range of function and check for branching points.
-  for (int lineNum = function->defLoc; lineNum < function->endLoc; lineNum++) {
-    if (MAP_FIND(getBranchDictionary(), lineNum)) {
-      program << DECLARE_BRANCH((*branchCount)++);
+    unsigned *branchCount, const std::vector<bool> &testedFlags) {
+  // Iterate over the branching points within the range of the function.
+  const FlatLineMap<std::vector<BranchTarget>> &branchDict =
+      getBranchDictionary();
+  FlatLineMap<std::vector<BranchTarget>>::const_iterator BP =
+      branchDict.lower_bound(function->defLoc);
+  if (BP != branchDict.end() && BP->first < function->endLoc) {
+    program << DECLARE_BRANCH_MAX;
+  }
+  for (; BP != branchDict.end() && BP->first < function->endLoc; ++BP) {
+    if (testedFlags[BP - branchDict.begin()]) {
+      program << DECLARE_BRANCH(*branchCount);
     }
+    (*branchCount)++;
   }
   program << '\n';
 }
 
-void KeyPointsCollector::compileModified() {
-  // See what compiler we are working with on the machine.
-#if defined(__clang__)
-  std::string c_compiler("clang");
-#elif defined(__GNUC__)
-  std::string c_compiler("gcc");
-#endif
-  if (c_compiler.empty()) {
-    c_compiler = std::getenv("CC");
-    if (c_compiler.empty()) {
-      std::cerr << "No viable C compiler found on system!\n";
-      exit(EXIT_FAILURE);
-    }
-  }
-  std::cout << "C compiler is: " << c_compiler << '\n';
+bool KeyPointsCollector::compileModified() {
+  const Compiler compiler;
+  std::cout << "C compiler is: " << compiler.getName() << '\n';
 
   // Ensure that the modified program exists
   if (!static_cast<bool>(std::ifstream(MODIFIED_PROGAM_OUT).good())) {
     std::cerr << "Transformed program has not been created yet!\n";
-    exit(EXIT_FAILURE);
+    return false;
   }
 
-  // Construct compilation command.
-  std::stringstream compilationCommand;
-  compilationCommand << c_compiler << " -w -O0 " << MODIFIED_PROGAM_OUT
-                     << " -o " << EXE_OUT;
-
   // Compile
-  bool compiled = static_cast<bool>(system(compilationCommand.str().c_str()));
-
-  // Check if compiled properly
-  if (compiled == EXIT_SUCCESS) {
+  std::chrono::milliseconds elapsed;
+  if (compiler.compile(
+          getModifiedCompileArgs(options.optLevel,
+                                 options.inProcess ? SHARED_OUT : EXE_OUT),
+          &elapsed)) {
     std::cout << "Compilation Successful" << '\n';
-  } else {
-    std::cerr << "There was an error with compilation, exiting!\n";
-    exit(EXIT_FAILURE);
+    if (debug) {
+      std::cout << "Compiled modified program in " << elapsed.count()
+                << " ms\n";
+    }
+    return true;
   }
+  std::cerr << "There was an error with compilation of " << filename << "!\n";
+  return false;
 }
 
-void KeyPointsCollector::invokeValgrind() {
-  // First compile the original program
-#if defined(__clang__)
-  std::string c_compiler("clang");
-#elif defined(__GNUC__)
-  std::string c_compiler("gcc");
-#endif
-  if (c_compiler.empty()) {
-    c_compiler = std::getenv("CC");
-    if (c_compiler.empty()) {
-      std::cerr << "No viable C compiler found on system!\n";
-      exit(EXIT_FAILURE);
-    }
+std::vector<std::string>
+KeyPointsCollector::getModifiedCompileArgs(const std::string &optLevel,
+                                           const std::string &output) const {
+  // The modified program lives in the out directory, so add the original
+  // directory for any local includes.
+  const std::string sourceDir =
+      std::filesystem::path(filename).parent_path().string();
+  std::vector<std::string> args{"-w", "-O" + optLevel, "-DKPC_TRACE",
+                                "-I" + (sourceDir.empty() ? "." : sourceDir)};
+  args.insert(args.end(), compilerArgs.begin(), compilerArgs.end());
+  if (options.inProcess) {
+    // A shared object kpc loads and runs, see IN_PROCESS_RUNTIME.
+    args.insert(args.end(), {"-shared", "-fPIC", "-Dmain=kpc_main",
+                             "-Dexit=kpc_exit_program"});
+  }
+  args.insert(args.end(), {MODIFIED_PROGAM_OUT, "-o", output});
+  if (options.binaryTrace()) {
+    args.push_back("-pthread");
   }
+  return args;
+}
+
+std::vector<std::string>
+KeyPointsCollector::getOriginalCompileArgs(const std::string &optLevel,
+                                           const std::string &output) const {
+  // Like the modified program, the formatted source lives in the out
+  // directory.
+  const std::string sourceDir =
+      std::filesystem::path(filename).parent_path().string();
+  std::vector<std::string> args{"-O" + optLevel, "-g",
+                                "-I" + (sourceDir.empty() ? "." : sourceDir)};
+  args.insert(args.end(), compilerArgs.begin(), compilerArgs.end());
+  args.insert(args.end(), {FORMATTED_OUT, "-o", output});
+  return args;
+}
 
-  // Check we acutally have a file to compile
-  if (!static_cast<bool>(std::ifstream(filename).good())) {
+bool KeyPointsCollector::writeFormattedSource() {
+  std::ofstream formatted(FORMATTED_OUT);
+  formatted << sourceBuffer;
+  formatted.close();
+  return !sourceBuffer.empty() && formatted.good();
+}
+
+bool KeyPointsCollector::compileOriginal() {
+  // Write out the formatted source and check we acutally have a file to
+  // compile
+  if (!writeFormattedSource()) {
     std::cerr << "No program to compile!\n";
-    exit(EXIT_FAILURE);
+    return false;
   }
 
-  // Construct compilation command.
-  std::stringstream shellCommandStream;
-  shellCommandStream << c_compiler << " -O0 " << filename << " -o "
-                     << ORIGINAL_EXE_OUT;
+  std::chrono::milliseconds elapsed;
+  originalBuilt = Compiler().compile(
+      getOriginalCompileArgs(options.optLevel, ORIGINAL_EXE_OUT), &elapsed);
+  if (originalBuilt && debug) {
+    std::cout << "Compiled original program in " << elapsed.count()
+              << " ms\n";
+  }
+  return originalBuilt;
+}
 
-  // Compile
-  bool compiled = static_cast<bool>(system(shellCommandStream.str().c_str()));
+bool KeyPointsCollector::compileConcurrently() {
+  const Compiler compiler;
+  std::cout << "C compiler is: " << compiler.getName() << '\n';
+  if (!static_cast<bool>(std::ifstream(MODIFIED_PROGAM_OUT).good())) {
+    std::cerr << "Transformed program has not been created yet!\n";
+    return false;
+  }
+  const bool formatted = writeFormattedSource();
+
+  // Neither build depends on the other, run them side by side.
+  const std::chrono::steady_clock::time_point start =
+      std::chrono::steady_clock::now();
+  std::chrono::milliseconds originalTime(0);
+  std::thread originalBuild([&]() {
+    originalBuilt =
+        formatted &&
+        compiler.compile(
+            getOriginalCompileArgs(options.optLevel, ORIGINAL_EXE_OUT),
+            &originalTime);
+  });
+  std::chrono::milliseconds modifiedTime(0);
+  const bool modifiedBuilt = compiler.compile(
+      getModifiedCompileArgs(options.optLevel,
+                             options.inProcess ? SHARED_OUT : EXE_OUT),
+      &modifiedTime);
+  originalBuild.join();
+
+  std::cout << "Built original in " << originalTime.count()
+            << " ms and modified in " << modifiedTime.count() << " ms, "
+            << std::chrono::duration_cast<std::chrono::milliseconds>(
+                   std::chrono::steady_clock::now() - start)
+                   .count()
+            << " ms in total\n";
+  if (!originalBuilt) {
+    std::cerr << "There was an error with compilation of the original "
+              << filename << "!\n";
+  }
+  if (modifiedBuilt) {
+    std::cout << "Compilation Successful" << '\n';
+    return true;
+  }
+  std::cerr << "There was an error with compilation of " << filename << "!\n";
+  return false;
+}
 
-  // Check if compiled properly
-  if (compiled == EXIT_SUCCESS) {
+void KeyPointsCollector::countInstructions() {
+  // First compile the original program, unless it was built alongside the
+  // modified one.
+  if (originalBuilt) {
+    std::cout << "Compilation Successful" << '\n';
+  } else if (compileOriginal()) {
     std::cout << "Compilation Successful" << '\n';
   } else {
     std::cerr << "There was an error with compilation, exiting!\n";
     exit(EXIT_FAILURE);
   }
 
-  // Clear stream and construt valgrind command
-  const std::string valgrindLogFile(OUT_DIR + filename + ".VALGRIND_OUT");
-  shellCommandStream.str("");
-  shellCommandStream.clear();
-  shellCommandStream << "valgrind --tool=callgrind --dump-instr=yes --log-file="
-                     << valgrindLogFile << " " << ORIGINAL_EXE_OUT;
+  // Run it once under the hardware counters, or Callgrind without them.
+  InstructionCounter counter(ORIGINAL_EXE_OUT, CALLGRIND_LOG, CALLGRIND_OUT);
+  if (!counter.run(options.attributeCosts)) {
+    return;
+  }
+  counter.print(std::cout);
+
+  if (options.attributeCosts) {
+    CallgrindProfile profile(CALLGRIND_OUT);
+    if (profile.load(FORMATTED_OUT)) {
+      std::ofstream costs(COSTS_OUT);
+      writeCostReport(profile, costs);
+      writeCostReport(profile, std::cout);
+    }
+  }
+}
 
-  // Run valgrind
-  bool valgrind = static_cast<bool>(system(shellCommandStream.str().c_str()));
+bool KeyPointsCollector::compareOptLevels() {
+  if (options.inProcess) {
+    std::cerr << "Optimization levels are not compared for in-process runs!\n";
+    return false;
+  }
+  if (!writeFormattedSource()) {
+    std::cerr << "No program to compile!\n";
+    return false;
+  }
+  std::vector<std::string> levels{"0", "1", "2", "3"};
+  if (std::find(levels.begin(), levels.end(), options.optLevel) ==
+      levels.end()) {
+    levels.push_back(options.optLevel);
+  }
 
-  // If successful, invoke python script to collect executed number of
-  // instructions.
-  if (valgrind == EXIT_SUCCESS) {
-    std::cout << "Valgrind invoked successfully\n";
-    // First remove the call grind files generated.
-    system("rm -r callgrind*");
-    // Invoke python script
-    shellCommandStream.str("");
-    shellCommandStream.clear();
-    shellCommandStream << "python3 " << VALGRIND_PARSER << " "
-                       << valgrindLogFile;
-    system(shellCommandStream.str().c_str());
+  const Compiler compiler;
+  std::ostringstream report;
+  report << std::left << std::setw(8) << "Level" << std::right
+         << std::setw(16) << "original" << std::setw(16) << "instrumented"
+         << std::setw(12) << "overhead" << '\n';
+  unsigned levelsCounted = 0;
+  for (const std::string &level : levels) {
+    const std::string prefix(OUT_DIR + filename + ".O" + level);
+    const std::string original(prefix + ".original.out");
+    const std::string modified(prefix + ".modified.out");
+    if (!compiler.compile(getOriginalCompileArgs(level, original)) ||
+        !compiler.compile(getModifiedCompileArgs(level, modified))) {
+      std::cerr << "There was an error with compilation at -O" << level
+                << "!\n";
+      continue;
+    }
+
+    // The modified program's trace is not what is being looked at.
+    InstructionCounter originalCounter(original, original + ".VALGRIND_OUT",
+                                       original + ".callgrind.out");
+    InstructionCounter modifiedCounter(modified, modified + ".VALGRIND_OUT",
+                                       modified + ".callgrind.out");
+    originalCounter.discardOutput = true;
+    modifiedCounter.discardOutput = true;
+
+    // Each level writes its own trace and profile, e.g. <file>.O2.trace,
+    // instead of every level overwriting those of the toolchain run.
+    switch (options.traceFormat) {
+    case TraceFormat::Binary:
+    case TraceFormat::Threaded:
+      modifiedCounter.environment.push_back("KPC_TRACE_FILE=" + prefix +
+                                            ".trace");
+      break;
+    case TraceFormat::Counters:
+      modifiedCounter.environment.push_back("KPC_TRACE_FILE=" + prefix +
+                                            ".counts");
+      break;
+    case TraceFormat::Coverage:
+      modifiedCounter.environment.push_back("KPC_TRACE_FILE=" + prefix +
+                                            ".coverage");
+      break;
+    case TraceFormat::Text:
+      break;
+    }
+    if (options.profile) {
+      modifiedCounter.environment.push_back("KPC_PROFILE_FILE=" + prefix +
+                                            ".profile");
+    }
+    if (!originalCounter.run() || !modifiedCounter.run()) {
+      continue;
+    }
+    ++levelsCounted;
+    const double overhead =
+        originalCounter.instructions != 0
+            ? 100.0 *
+                  (static_cast<double>(modifiedCounter.instructions) -
+                   static_cast<double>(originalCounter.instructions)) /
+                  originalCounter.instructions
+            : 0;
+    report << std::left << std::setw(8) << ("-O" + level) << std::right
+           << std::setw(16) << originalCounter.instructions << std::setw(16)
+           << modifiedCounter.instructions << std::setw(11) << std::fixed
+           << std::setprecision(1) << std::showpos << overhead
+           << std::noshowpos << "%\n";
+  }
+
+  // Without counters or Callgrind there is nothing to compare, and an empty
+  // table, or one left by an earlier run, would read as a result.
+  if (levelsCounted == 0) {
+    std::remove(OPT_REPORT_OUT.c_str());
+    std::cerr << "No instruction counts could be collected at any "
+                 "optimization level, no report written!\n";
+    return false;
   }
+  std::ofstream(OPT_REPORT_OUT) << report.str();
+  std::cout << '\n' << report.str();
+  return true;
 }
 
-void KeyPointsCollector::executeToolchain() {
+void KeyPointsCollector::writeCostReport(const CallgrindProfile &profile,
+                                         std::ostream &out) {
+  const std::map<unsigned, CallgrindProfile::LineCost> &lineCosts =
+      profile.getLineCosts();
+
+  // Where each function of the file is defined.
+  std::unordered_map<std::string, unsigned> definitions;
+  for (const std::pair<unsigned, std::shared_ptr<FunctionDeclInfo>> &func :
+       getFuncDecls()) {
+    if (func.second->definition) {
+      definitions[func.second->name] = func.second->defLoc;
+    }
+  }
+
+  // Instructions executed on lines first..last, without and with calls.
+  // Self costs already add up every invocation of the enclosing function
+  // funcFirst..funcLast, so calls back into it, recursion, are left out of
+  // the inclusive cost as they would count those lines again.
+  auto rangeCost = [&](unsigned first, unsigned last, unsigned funcFirst,
+                       unsigned funcLast) {
+    uint64_t self = 0;
+    uint64_t calls = 0;
+    for (auto line = lineCosts.lower_bound(first);
+         line != lineCosts.end() && line->first <= last; ++line) {
+      self += line->second.self;
+      calls += line->second.calls;
+      for (const std::pair<const std::string, uint64_t> &call :
+           line->second.sourceCalls) {
+        std::unordered_map<std::string, unsigned>::const_iterator callee =
+            definitions.find(call.first);
+        if (callee != definitions.end() && callee->second >= funcFirst &&
+            callee->second <= funcLast) {
+          calls -= call.second;
+        }
+      }
+    }
+    return std::make_pair(self, self + calls);
+  };
+
+  // Functions by inclusive cost.
+  std::vector<std::pair<std::pair<uint64_t, uint64_t>, std::string>>
+      functionCosts;
+  for (const std::pair<unsigned, std::shared_ptr<FunctionDeclInfo>> &func :
+       getFuncDecls()) {
+    if (!func.second->definition) {
+      continue;
+    }
+    functionCosts.emplace_back(rangeCost(func.second->defLoc,
+                                         func.second->endLoc,
+                                         func.second->defLoc,
+                                         func.second->endLoc),
+                               func.second->name);
+  }
+  std::sort(functionCosts.begin(), functionCosts.end(),
+            [](const auto &A, const auto &B) {
+              return A.first.second > B.first.second;
+            });
+
+  // An arm ends before the next line where another arm starts or a branch
+  // point is, or at the end of its function.
+  std::vector<unsigned> keyLines;
+  for (const std::pair<unsigned, std::vector<BranchTarget>> &BP :
+       getBranchDictionary()) {
+    keyLines.push_back(BP.first);
+    for (const BranchTarget &target : BP.second) {
+      keyLines.push_back(target.targetLine);
+    }
+  }
+  std::sort(keyLines.begin(), keyLines.end());
+
+  // Arms by inclusive cost, with their first and last line.
+  struct ArmCost {
+    uint64_t instructions;
+    unsigned id;
+    unsigned first;
+    unsigned last;
+  };
+  std::vector<ArmCost> armCosts;
+  for (const std::pair<unsigned, std::vector<BranchTarget>> &BP :
+       getBranchDictionary()) {
+    FlatLineMap<std::shared_ptr<FunctionDeclInfo>>::const_iterator func =
+        getFuncDecls().lower_bound(BP.first + 1);
+    const unsigned funcStart =
+        func != getFuncDecls().begin() ? std::prev(func)->second->defLoc
+                                       : BP.first;
+    const unsigned funcEnd =
+        func != getFuncDecls().begin() ? std::prev(func)->second->endLoc
+                                       : BP.first;
+    for (const BranchTarget &target : BP.second) {
+      std::vector<unsigned>::const_iterator next = std::upper_bound(
+          keyLines.begin(), keyLines.end(), target.targetLine);
+      const unsigned last =
+          next != keyLines.end() && *next <= funcEnd ? *next - 1 : funcEnd;
+      armCosts.push_back(
+          {rangeCost(target.targetLine, last, funcStart, funcEnd).second,
+           target.id, target.targetLine, last});
+    }
+  }
+  std::sort(armCosts.begin(), armCosts.end(),
+            [](const ArmCost &A, const ArmCost &B) {
+              return A.instructions > B.instructions;
+            });
+
+  out << "Instructions executed: " << profile.getTotal() << "\n\n"
+      << "Functions (self, inclusive):\n";
+  for (const auto &cost : functionCosts) {
+    out << cost.second << ": " << cost.first.first << ", "
+        << cost.first.second << '\n';
+  }
+  out << "\nBranch arms (inclusive, lines):\n";
+  for (const ArmCost &cost : armCosts) {
+    out << BRANCH_ID(cost.id) << ": " << cost.instructions << ", "
+        << cost.first << "-" << cost.last << '\n';
+  }
+}
+
+bool KeyPointsCollector::runToolchain() {
+  if (!loaded) {
+    return false;
+  }
   collectCursors();
   createDictionaryFile();
-  transformProgram();
-  compileModified();
+  if (!transformProgram()) {
+    return false;
+  }
+  return options.concurrentBuild ? compileConcurrently() : compileModified();
+}
+
+void KeyPointsCollector::executeWatchSession() {
+  if (!runToolchain()) {
+    std::cerr << "Toolchain failed, waiting for changes.\n";
+  }
+  std::cout << "\nWatching " << filename
+            << " for changes, press Ctrl-C to stop.\n";
+
+  std::filesystem::file_time_type lastWrite =
+      std::filesystem::last_write_time(filename);
+  while (true) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(WATCH_POLL_MS));
+    std::error_code error;
+    std::filesystem::file_time_type writeTime =
+        std::filesystem::last_write_time(filename, error);
+    if (error || writeTime == lastWrite) {
+      continue;
+    }
+    lastWrite = writeTime;
+
+    std::chrono::steady_clock::time_point start =
+        std::chrono::steady_clock::now();
+    if (!reanalyze()) {
+      continue;
+    }
+    std::chrono::steady_clock::time_point analyzed =
+        std::chrono::steady_clock::now();
+    createDictionaryFile();
+    const bool compiled = transformProgram() && compileModified();
+    std::chrono::steady_clock::time_point done =
+        std::chrono::steady_clock::now();
+
+    std::cout << "Reanalyzed in "
+              << std::chrono::duration_cast<std::chrono::milliseconds>(
+                     analyzed - start)
+                     .count()
+              << " ms, " << (compiled ? "reinstrumented" : "failed")
+              << " in "
+              << std::chrono::duration_cast<std::chrono::milliseconds>(
+                     done - start)
+                     .count()
+              << " ms\n";
+  }
+}
+
+void KeyPointsCollector::executeToolchain() {
+  if (!runToolchain() ||
+      (options.compareOptLevels && !compareOptLevels())) {
+    std::cerr << "Toolchain failed, exiting!\n";
+    exit(EXIT_FAILURE);
+  }
   std::cout << "\nToolchain was successful, the branch dicitonary, modified "
                "file, and executable have been written to the "
             << OUT_DIR << " directory \n";
 
   char decision;
-  std::cout << "\nWould you like to invoke Valgrind? (y/n) ";
+  std::cout << "\nWould you like to count the executed instructions? (y/n) ";
   std::cin >> decision;
   if (decision == 'y') {
-    invokeValgrind();
+    countInstructions();
   }
 
   std::cout << "\nWould you like to out put the branch pointer trace for the "
                "program? (y/n) ";
   std::cin >> decision;
   if (decision == 'y') {
-    system(EXE_OUT.c_str());
+    if (options.inProcess) {
+      runInProcess([](const TraceEvent &event) {
+        TraceDecoder::writeEvent(event, std::cout);
+      });
+    } else if (options.binaryTrace()) {
+      runModified([](const TraceEvent &event) {
+        TraceDecoder::writeEvent(event, std::cout);
+      });
+    } else {
+      system(EXE_OUT.c_str());
+    }
+    if (options.traceFormat == TraceFormat::Coverage) {
+      std::cout << "\nCoverage map written to " << COVERAGE_OUT << '\n';
+    }
+    if (options.profile) {
+      std::cout << "\nFlat profile written to " << PROFILE_OUT << '\n';
+    }
   }
 }
 
 std::string KeyPointsCollector::getBPTrace() {
+  if (!loaded) {
+    return std::string();
+  }
+
+  // In counter mode there are no events, the counts file is the trace.
+  if (options.traceFormat == TraceFormat::Counters) {
+    collectCursors();
+    if (!transformProgram() || !compileModified() ||
+        !runForResults(COUNTS_OUT)) {
+      return std::string();
+    }
+    std::ifstream counts(COUNTS_OUT);
+    std::stringstream countsStream;
+    countsStream << counts.rdbuf();
+    return countsStream.str();
+  }
+
+  // Same for coverage mode, with the reached buckets of each edge.
+  if (options.traceFormat == TraceFormat::Coverage) {
+    collectCursors();
+    CoverageMap coverage;
+    if (!transformProgram() || !compileModified() ||
+        !runForResults(COVERAGE_OUT) || !coverage.load(COVERAGE_OUT)) {
+      return std::string();
+    }
+    std::ostringstream coverageStream;
+    coverage.write(coverageStream);
+    return coverageStream.str();
+  }
+
+  std::ostringstream trace;
+  if (!streamBPTrace([&trace](const TraceEvent &event) {
+        TraceDecoder::writeEvent(event, trace);
+      })) {
+    return std::string();
+  }
+  return trace.str();
+}
+
+bool KeyPointsCollector::runForResults(const std::string &results) {
+  // Results left by an earlier run must not pass for this one's.
+  std::remove(results.c_str());
+  const int status = system(EXE_OUT.c_str());
+  if (status == -1) {
+    std::cerr << "Could not run " << EXE_OUT << "!\n";
+    return false;
+  }
+  // Like a trace, the results are what the program reached before it ended.
+  if (WIFEXITED(status) && WEXITSTATUS(status) != EXIT_SUCCESS) {
+    std::cerr << EXE_OUT << " exited with status " << WEXITSTATUS(status)
+              << '\n';
+  } else if (WIFSIGNALED(status)) {
+    std::cerr << EXE_OUT << " was killed by signal " << WTERMSIG(status)
+              << '\n';
+  }
+  if (!std::filesystem::exists(results)) {
+    std::cerr << EXE_OUT << " wrote no " << results << "!\n";
+    return false;
+  }
+  return true;
+}
+
+bool KeyPointsCollector::streamBPTrace(const TraceCallback &onEvent) {
+  if (!loaded) {
+    return false;
+  }
   collectCursors();
-  transformProgram();
-  compileModified();
-  std::vector<char> buffer(128);
-  std::string result;
-  std::unique_ptr<FILE, decltype(&pclose)> pipe(popen(EXE_OUT.c_str(), "r"),
+  if (!transformProgram() || !compileModified()) {
+    return false;
+  }
+  return options.inProcess ? runInProcess(onEvent) : runModified(onEvent);
+}
+
+void KeyPointsCollector::forwardEvent(void *onEvent, unsigned kind,
+                                      unsigned id, const void *ptr) {
+  (*static_cast<const TraceCallback *>(onEvent))(
+      {kind == TRACE_BRANCH ? TraceEvent::Branch : TraceEvent::Func, id,
+       reinterpret_cast<uintptr_t>(ptr), 0, 0});
+}
+
+bool KeyPointsCollector::runInProcess(const TraceCallback &onEvent) {
+  // Loaded fresh for every run, so the program's globals start over.
+  void *program = dlopen(SHARED_OUT.c_str(), RTLD_NOW | RTLD_LOCAL);
+  if (program == nullptr) {
+    std::cerr << "Could not load " << SHARED_OUT << ": " << dlerror() << "!\n";
+    return false;
+  }
+  using EventFunction = void (*)(void *, unsigned, unsigned, const void *);
+  using RunFunction = int (*)(EventFunction, void *);
+  const RunFunction run =
+      reinterpret_cast<RunFunction>(dlsym(program, "kpc_run"));
+  if (run == nullptr) {
+    std::cerr << SHARED_OUT << " was not built for in-process runs!\n";
+    dlclose(program);
+    return false;
+  }
+
+  // Events reach onEvent straight from the program's LOG calls.
+  std::cout.flush();
+  run(&KeyPointsCollector::forwardEvent,
+      const_cast<TraceCallback *>(&onEvent));
+  dlclose(program);
+
+  // dlclose does not have to unload the object, then the next run starts
+  // with the globals this one left.
+  void *stillLoaded = dlopen(SHARED_OUT.c_str(), RTLD_NOW | RTLD_NOLOAD);
+  if (stillLoaded != nullptr) {
+    dlclose(stillLoaded);
+    std::cerr << SHARED_OUT << " was not unloaded, the globals of its next "
+                               "run will not start over!\n";
+  }
+  return true;
+}
+
+bool KeyPointsCollector::runModified(const TraceCallback &onEvent) {
+  if (options.traceFormat == TraceFormat::Counters) {
+    std::cerr << "Counter mode does not record a trace of events!\n";
+    return false;
+  }
+  if (options.traceFormat == TraceFormat::Coverage) {
+    std::cerr << "Coverage mode does not record a trace of events!\n";
+    return false;
+  }
+
+  // A binary trace is written to the pipe instead of the trace file, and the
+  // program's own output goes to stderr so it does not get in the way.
+  std::string command(EXE_OUT);
+  if (options.binaryTrace()) {
+    command = "KPC_TRACE_FILE=/dev/fd/3 " + EXE_OUT + " 3>&1 1>&2";
+  }
+  std::unique_ptr<FILE, decltype(&pclose)> pipe(popen(command.c_str(), "r"),
                                                 pclose);
-  while (fgets(buffer.data(), buffer.size(), pipe.get()) != nullptr) {
-    result += buffer.data();
+  if (pipe == nullptr) {
+    std::cerr << "Could not run " << EXE_OUT << "!\n";
+    return false;
+  }
+
+  // Events are parsed and handed on as the program produces them.
+  if (options.binaryTrace()) {
+    return TraceDecoder::decodeBinary(fileno(pipe.get()), EXE_OUT, onEvent);
   }
-  return result;
+  return TraceDecoder::decodeText(fileno(pipe.get()), onEvent);
 }
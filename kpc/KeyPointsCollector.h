@@ -4,7 +4,11 @@
 #ifndef KEY_POINTS_COLLECTOR__H
 #define KEY_POINTS_COLLECTOR__H
 
+#include "CallgrindProfile.h"
 #include "Common.h"
+#include "FlatLineMap.h"
+#include "KPCOptions.h"
+#include "TraceDecoder.h"
 #include <clang-c/Index.h>
 
 #include <iostream>
@@ -12,6 +16,7 @@
 #include <memory>
 #include <stack>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
 class KeyPointsCollector {
@@ -34,6 +39,11 @@ class KeyPointsCollector {
   // to be grouped together.
   inline static CXIndex KPCIndex = clang_createIndex(0, 0);
 
+  // Index this instance parses into, the shared KPCIndex unless one was given.
+  // Parallel batches hand each worker its own index, as a CXIndex must not be
+  // used from several threads at once.
+  CXIndex index;
+
   // Top level translation unit of the source file.
   CXTranslationUnit translationUnit;
 
@@ -43,6 +53,67 @@ class KeyPointsCollector {
   // Debug option
   bool debug;
 
+  // Options this instance was created with.
+  const KPCOptions options;
+
+  // Extra compiler arguments (include paths, defines, language standard) used
+  // both when parsing and when compiling the original and modified programs.
+  std::vector<std::string> compilerArgs;
+
+  // True when the analysis was restored from the on-disk cache, in that case
+  // no translation unit is parsed and collectCursors() has nothing to do.
+  bool loadedFromCache;
+
+  // True once the file was read and parsed, or restored from the cache. A
+  // missing file or a failed parse leaves it false, and the toolchain fails
+  // without doing anything, so batches can carry on with other files.
+  bool loaded;
+
+  // Hash of the formatted source, compiler flags and parse mode, the key for
+  // the on-disk cache.
+  uint64_t getCacheKey() const;
+
+  // Path of the cache file for this source.
+  std::string getCacheFilename() const {
+    return OUT_DIR + filename + ".kpc_cache";
+  }
+
+  // Restores the collected functions, calls, pointers, variables and branch
+  // dictionary from the cache. Returns false on a miss or a stale cache.
+  bool loadCache();
+
+  // Writes the collected analysis to the cache.
+  void saveCache();
+
+  // Parses the translation unit from parseBuffer with the parse options for
+  // the current mode.
+  void parseTranslationUnit();
+
+  // Returns the path to a precompiled header holding the file's include
+  // directives, building and caching it under PCH_DIR on first use. Returns an
+  // empty string if there are no includes or the PCH could not be built.
+  std::string getIncludesPCH();
+
+  // Arguments for compiling the modified program, and the original program
+  // from its formatted source, at an optimization level to output.
+  std::vector<std::string>
+  getModifiedCompileArgs(const std::string &optLevel,
+                         const std::string &output) const;
+  std::vector<std::string>
+  getOriginalCompileArgs(const std::string &optLevel,
+                         const std::string &output) const;
+
+  // Writes the formatted source to the out directory. Returns false if there
+  // is no source or it could not be written.
+  bool writeFormattedSource();
+
+  // Is the original program built from the current source?
+  bool originalBuilt;
+
+  // Writes out the formatted source and compiles the original program from
+  // it. Returns true if compilation succeeded.
+  bool compileOriginal();
+
   // Map to hold include directives
   std::map<unsigned, std::string> includeDirectives;
 
@@ -51,11 +122,21 @@ class KeyPointsCollector {
     includeDirectives[lineNum] = includeDirective;
   }
 
-  // Method to remove include directives from source file before parsing.
-  void removeIncludeDirectives();
+  // Formatted source of the file, read once and kept in memory. The original
+  // file on disk is never modified, the transform reads from this buffer.
+  std::string sourceBuffer;
+
+  // Source handed to the parser as an unsaved file, same as sourceBuffer but
+  // with the include directives stripped.
+  std::string parseBuffer;
 
-  // Method to reinsert include directives into source file.
-  void reInsertIncludeDirectives();
+  // Formats the file with clang-format into sourceBuffer, falling back to the
+  // unformatted contents if clang-format is not available.
+  void loadSource();
+
+  // Method to remove include directives from the source buffer before
+  // parsing, filling parseBuffer.
+  void removeIncludeDirectives();
 
   // This is a weird one, since clang_visitChildren requires a function ptr
   // for its second argument without any signature, its not possible to capture
@@ -70,9 +151,13 @@ class KeyPointsCollector {
   static CXChildVisitResult VisitCompoundStmt(CXCursor current, CXCursor parent,
                                               CXClientData kpc);
 
-  // Visitor for a CallExpr, to collect the function signature.
-  static CXChildVisitResult VisitCallExpr(CXCursor current, CXCursor parent,
-                                          CXClientData kpc);
+  // Visitor storing the first child of a cursor into the CXCursor pointed to
+  // by the client data.
+  static CXChildVisitResult VisitFirstChild(CXCursor current, CXCursor parent,
+                                            CXClientData child);
+
+  // Collects the function called by a CallExpr, if it is a user function.
+  void collectCall(CXCursor callExpr);
 
   // Visitor for a FuncDecl, to collect name and defintion location.
   static CXChildVisitResult VisitFuncDecl(CXCursor current, CXCursor parent,
@@ -91,8 +176,41 @@ class KeyPointsCollector {
   // represent.
   std::map<std::string, std::string> funcPtrs;
 
-  // Current func ptr id being looked at.
-  std::string currFuncPtrId;
+  // Maps declaration cursors to integer ids. Lookups hash the cursor with
+  // clang_hashCursor and compare with clang_equalCursors, so resolving a
+  // referenced cursor needs no lexing or string work.
+  struct CursorIdMap {
+    std::unordered_multimap<unsigned, std::pair<CXCursor, unsigned>> entries;
+
+    void insert(CXCursor C, unsigned id) {
+      const unsigned hash = clang_hashCursor(C);
+      auto range = entries.equal_range(hash);
+      for (auto entry = range.first; entry != range.second; ++entry) {
+        if (clang_equalCursors(entry->second.first, C)) {
+          entry->second.second = id;
+          return;
+        }
+      }
+      entries.emplace(hash, std::make_pair(C, id));
+    }
+
+    bool find(CXCursor C, unsigned *id) const {
+      auto range = entries.equal_range(clang_hashCursor(C));
+      for (auto entry = range.first; entry != range.second; ++entry) {
+        if (clang_equalCursors(entry->second.first, C)) {
+          *id = entry->second.second;
+          return true;
+        }
+      }
+      return false;
+    }
+
+    void clear() { entries.clear(); }
+  };
+
+  // Canonical function pointer declarations mapped to the id of the function
+  // they point to.
+  CursorIdMap funcPtrIdsByCursor;
 
   // See if an Id maps to a function pointer
   std::string isFunctionPtr(const std::string &id) {
@@ -118,15 +236,22 @@ class KeyPointsCollector {
     const std::string type;
     // Is it a recursive function?
     bool recursive;
+    // Does it have a body, or is it a prototype?
+    bool definition;
+    // Interned id, shared by every declaration with the same USR.
+    unsigned id;
 
     FunctionDeclInfo(unsigned defLoc, unsigned endLoc, const std::string &name,
                      const std::string &type)
         : defLoc(defLoc), endLoc(endLoc), name(std::move(name)),
-          type(std::move(type)) {}
+          type(std::move(type)), recursive(false), definition(false), id(0) {}
 
     // Sets the recursive marker
     void setRecursive() { recursive = true; }
 
+    // Sets the definition marker
+    void setDefinition() { definition = true; }
+
     // Is this line number inside this func body?
     bool isInBody(unsigned lineNum) {
       return lineNum >= defLoc && lineNum <= endLoc;
@@ -139,12 +264,33 @@ class KeyPointsCollector {
     funcDeclsString[decl->name] = decl;
   }
 
+  // Function ids interned by USR. Only touched once per declaration.
+  std::unordered_map<std::string, unsigned> funcIdsByUSR;
+
+  // Functions indexed by interned id, the latest declaration seen wins.
+  std::vector<std::shared_ptr<FunctionDeclInfo>> funcsById;
+
+  // Canonical declaration cursors mapped to function ids.
+  CursorIdMap funcIdsByCursor;
+
+  // Interns the function declared at cursor C by its USR, and registers its
+  // canonical cursor so references to it resolve to decl.
+  void internFunction(CXCursor C, std::shared_ptr<FunctionDeclInfo> decl);
+
+  // Resolves the function a cursor refers to, either directly or through a
+  // known function pointer, via clang_getCursorReferenced. Sets viaPointer
+  // when resolved through a pointer. Returns nullptr if it refers to no user
+  // function.
+  std::shared_ptr<FunctionDeclInfo> resolveCallee(CXCursor C,
+                                                  bool *viaPointer);
+
   // Functions are stored being mapped from their definition line number to
   // their respective structs.
-  std::map<unsigned, std::shared_ptr<FunctionDeclInfo>> funcDecls;
+  FlatLineMap<std::shared_ptr<FunctionDeclInfo>> funcDecls;
 
   // Additional map for function lookup by name
-  std::map<std::string, std::shared_ptr<FunctionDeclInfo>> funcDeclsString;
+  std::unordered_map<std::string, std::shared_ptr<FunctionDeclInfo>>
+      funcDeclsString;
   //
   // Function getter by string
   std::shared_ptr<FunctionDeclInfo> getFunctionByName(const std::string &name) {
@@ -163,7 +309,7 @@ class KeyPointsCollector {
   }
 
   // Map of line numbers mapped to the function being called
-  std::map<unsigned, std::string> functionCalls;
+  FlatLineMap<std::string> functionCalls;
 
   // Add a call to the call map
   void addCall(unsigned lineNum, const std::string &calleeName) {
@@ -210,15 +356,87 @@ class KeyPointsCollector {
   // Push a new BP onto the stack
   void pushNewBranchPoint() { branchPointStack.push(BranchPointInfo()); }
 
+  // A target of a branch point, its line number and integer branch id. The
+  // id is only formatted as e.g. 'br_2' on output.
+  struct BranchTarget {
+    unsigned targetLine;
+    unsigned id;
+
+    BranchTarget(unsigned targetLine, unsigned id)
+        : targetLine(targetLine), id(id) {}
+  };
+
   // Core branch dictionary
-  // The outer map holds the initial branch point line number,
-  // whilst the inner map holds the target line number for the branch,
-  // mapped to the branch id e.g. 'br_2'
-  std::map<unsigned, std::map<unsigned, std::string>> branchDictionary;
+  // Maps the initial branch point line number to its targets, sorted by
+  // target line number.
+  FlatLineMap<std::vector<BranchTarget>> branchDictionary;
+
+  // Finds the target on a line among a branch point's targets, nullptr if the
+  // line is not a target.
+  static const BranchTarget *
+  findTarget(const std::vector<BranchTarget> &targets, unsigned lineNum);
+
+  // Sets the id of the target on a line, keeping targets sorted by line.
+  static void setTarget(std::vector<BranchTarget> &targets, unsigned lineNum,
+                        unsigned id);
 
   // Called once branch analysis has completed.
   void addBranchesToDictionary();
 
+  // A branch target flattened out of the dictionary, point is the position of
+  // its branch point in the dictionary.
+  struct TargetEvent {
+    unsigned line;
+    unsigned point;
+    unsigned id;
+  };
+
+  // Returns every branch target sorted by target line, for the transform to
+  // walk alongside the source.
+  std::vector<TargetEvent> getTargetEvents() const;
+
+  // What was collected for one function in the previous analysis, with line
+  // numbers relative to the function's definition line. Used by reanalyze()
+  // to restore functions whose source did not change.
+  struct FunctionSnapshot {
+    // Hash of the function's source lines.
+    uint64_t textHash;
+    // Reused as is, only its location is updated.
+    std::shared_ptr<FunctionDeclInfo> decl;
+    // Branch point offset -> target offset -> branch id number.
+    std::map<unsigned, std::map<unsigned, unsigned>> branches;
+    // Call offset -> callee name.
+    std::map<unsigned, std::string> calls;
+    // Variable name -> declaration offset.
+    std::map<std::string, unsigned> vars;
+  };
+
+  // Snapshots of the previous analysis, keyed by function name.
+  std::map<std::string, FunctionSnapshot> functionSnapshots;
+
+  // Next unused branch id number, ids of unchanged functions are kept and new
+  // branch points are numbered from here.
+  unsigned nextBranchId;
+
+  // Returns lines first..last (1 based, inclusive) of the source buffer.
+  std::string getSourceLines(unsigned first, unsigned last) const;
+
+  // Snapshots every function of the current analysis into functionSnapshots.
+  void snapshotFunctions();
+
+  // Restores an unchanged function from its snapshot at a new definition line.
+  void restoreFunction(FunctionSnapshot &snapshot, unsigned defLoc);
+
+  // Numbers the branch points collected for a changed function, reusing the
+  // ids it had before where possible.
+  void addChangedBranchesToDictionary(const std::string &funcName);
+
+  // Top level visitor for reanalyze(), restores unchanged functions and walks
+  // everything else with VisitorFunctionCore.
+  static CXChildVisitResult VisitTopLevelIncremental(CXCursor current,
+                                                     CXCursor parent,
+                                                     CXClientData kpc);
+
   // Print found branch point
   void printFoundBranchPoint(const CXCursorKind K);
 
@@ -249,20 +467,71 @@ class KeyPointsCollector {
   // Add completed  branch to vector of branches and pop from stack;
   void addCompletedBranch();
 
+  // Completes every branch left on the stack, called at function boundaries
+  // where no further targets can follow.
+  void completePendingBranches();
+
   // Creates dictionary file of branch points.
   void createDictionaryFile();
 
-  // Iterates through the branch points and declares a flag for each one at the
-  // top of the program: e.g int br_1 = 0
+  // Returns the largest branch id in the dictionary.
+  unsigned getMaxBranchId() const;
+
+  // Writes the logging macros for the selected trace format at the top of the
+  // modified program, the in-process, binary, threaded, counter or coverage
+  // runtime, or TRANSFORM_HEADER, followed by the sampling layer when
+  // sampling and the profile runtime when profiling. All of it is only
+  // compiled in with KPC_TRACE defined.
+  void writeTransformHeader(std::ofstream &program);
+
+  // Logging call for a branch id in the selected trace format, streams as
+  // e.g. LOG("br_2") or LOG(2).
+  struct BranchLog {
+    unsigned id;
+    TraceFormat format;
+
+    friend std::ostream &operator<<(std::ostream &out, const BranchLog &log) {
+      if (log.format != TraceFormat::Text) {
+        return out << "LOG(" << log.id << ")";
+      }
+      return out << "LOG(\"" << BRANCH_ID(log.id) << "\")";
+    }
+  };
+
+  // Event callback given to an in-process run, onEvent is the TraceCallback.
+  static void forwardEvent(void *onEvent, unsigned kind, unsigned id,
+                           const void *ptr);
+
+  // Returns the logging call for a branch id.
+  BranchLog logBranch(unsigned id) const { return {id, options.traceFormat}; }
+
+  // Returns, by position in the branch dictionary, which branch flags the
+  // transform will test. Only lines that are a target of several entered
+  // branch points test flags, a single target only needs BRANCH_MAX.
+  std::vector<bool>
+  getTestedBranchFlags(const std::vector<TargetEvent> &targetEvents) const;
+
+  // Iterates through the branch points of the function, counting them, and
+  // declares a flag for each tested one at the top of the function: e.g int
+  // BRANCH_1 = 0, and BRANCH_MAX if it has any. Only called for definitions,
+  // after a prototype the declarations would land at file scope.
   void
   insertFunctionBranchPointDecls(std::ofstream &program,
                                  std::shared_ptr<FunctionDeclInfo> function,
-                                 int *branchCount);
+                                 unsigned *branchCount,
+                                 const std::vector<bool> &testedFlags);
 
 public:
   // KPC ctor, takes file name in, ownership is transfered to KPC.
-  // Inits the translation unit, invoking the clang parser.
-  KeyPointsCollector(const std::string &fileName, bool debug = false);
+  // Inits the translation unit, invoking the clang parser. Optional compiler
+  // arguments are forwarded to the parser and the compile steps.
+  KeyPointsCollector(const std::string &fileName, bool debug = false,
+                     const std::vector<std::string> &compilerArgs = {},
+                     CXIndex index = nullptr);
+
+  // KPC ctor taking the full set of options.
+  KeyPointsCollector(const std::string &fileName, const KPCOptions &options,
+                     CXIndex index = nullptr);
 
   // Dispose of necessary CX elements.
   ~KeyPointsCollector();
@@ -271,16 +540,18 @@ public:
   const std::vector<CXCursor> &getCursorObjs() const { return cursorObjs; }
 
   // Returns a reference to map of function defintions
-  const std::map<unsigned, std::shared_ptr<FunctionDeclInfo>> &
-  getFuncDecls() const {
+  const FlatLineMap<std::shared_ptr<FunctionDeclInfo>> &getFuncDecls() const {
     return funcDecls;
   }
 
   // Returns a reference the map of known function calls.
-  const std::map<unsigned, std::string> &getFuncCalls() const {
+  const FlatLineMap<std::string> &getFuncCalls() const {
     return functionCalls;
   }
 
+  // Returns the name of the file being analyzed.
+  const std::string &getFilename() const { return filename; }
+
   // Returns a reference to map of variable defintions
   const std::map<std::string, unsigned> &getVarDecls() const {
     return varDecls;
@@ -289,29 +560,83 @@ public:
   // Return pointer to CXFile
   CXFile *getCXFile() { return &cxFile; }
 
-  // Return reference to the translation unit
+  // Return reference to the translation unit, null if the analysis was
+  // restored from the cache.
   CXTranslationUnit &getTU() { return translationUnit; }
 
+  // Was the analysis restored from the on-disk cache?
+  bool isFromCache() const { return loadedFromCache; }
+
   // Get branch dictionary
-  const std::map<unsigned, std::map<unsigned, std::string>> &
-  getBranchDictionary() {
+  const FlatLineMap<std::vector<BranchTarget>> &getBranchDictionary() const {
     return branchDictionary;
   }
 
-  // Invokes Valgrind toolchain to analyze the original programs executed
-  // instructions.
-  void invokeValgrind();
-
-  // Does everything needed to get the branch pointer trace as a string.
+  // Writes the branch dictionary entries, one 'br_N: file, bp, target' line
+  // each, to the given stream. Ids are only unique within a file, qualifyIds
+  // writes them as 'file:br_N' for dictionaries spanning several files.
+  void writeBranchDictionary(std::ostream &out, bool qualifyIds = false);
+
+  // Compiles the original program, from the formatted source so its lines
+  // match the dictionary, and counts the instructions it executes, with
+  // hardware counters where the kernel allows it and Callgrind where it does
+  // not. When attributing costs Callgrind is always used and the cost report
+  // is written and printed.
+  void countInstructions();
+
+  // Builds the original and the modified program at -O0 to -O3, and the
+  // configured level, counts the instructions each executes, and writes a
+  // table of both counts and the instrumentation overhead per level. Returns
+  // false, writing no table, if no level could be counted.
+  bool compareOptLevels();
+
+  // Writes the instructions spent in every function and branch arm, most
+  // expensive first, from a Callgrind profile of the formatted source. A
+  // function's self cost is what its own lines executed, its inclusive cost
+  // adds everything called from them except recursive calls, whose lines
+  // are in the self cost already. An arm runs from its target line to the
+  // next branch point or target of the function, calls out of the function
+  // included.
+  void writeCostReport(const CallgrindProfile &profile, std::ostream &out);
+
+  // Does everything needed to get the branch pointer trace as a string, one
+  // 'br_N' or 'func_0x...' line per event. In counter mode the counts are
+  // returned instead, in coverage mode the reached edges. The whole trace is
+  // held in memory, use streamBPTrace() for long running programs.
   std::string getBPTrace();
+
+  // Does everything needed to run the modified program, calling onEvent for
+  // each trace event while it runs. Memory use does not grow with the trace.
+  // Returns false if compiling or decoding failed.
+  bool streamBPTrace(const TraceCallback &onEvent);
+
+  // Runs the already compiled modified program for the results it writes at
+  // exit to the given path. A nonzero exit status is reported, the results
+  // are still kept. Returns false if the program wrote none.
+  bool runForResults(const std::string &results);
+  //
+  // Runs the already compiled modified program, streaming its trace events
+  // to onEvent. Not available in counter and coverage mode.
+  bool runModified(const TraceCallback &onEvent);
+
+  // Loads the modified program, built as a shared object, into this process
+  // and runs its main, handing every trace event to onEvent as it happens.
+  // Only for in-process runs.
+  bool runInProcess(const TraceCallback &onEvent);
   //
   // Once the transformed program has been created, compile it with system C
-  // compiler.
-  void compileModified();
+  // compiler. Returns true if compilation succeeded.
+  bool compileModified();
+
+  // Compiles the original and the modified program at the same time, and
+  // reports how long each took. Returns true if the modified program, which
+  // the toolchain needs, compiled.
+  bool compileConcurrently();
 
   // Performs the transformation of the program so it can be compiled with
-  // branch statements.
-  void transformProgram();
+  // branch statements. Returns false if the modified file could not be
+  // written.
+  bool transformProgram();
 
   // Core AST traversal function, once the translation unit has been parsed,
   // recursively visit nodes and add to cursorObjs if they are of interest.
@@ -320,7 +645,25 @@ public:
   // Runs all necessary functions for part 1
   void executeToolchain();
 
+  // Re-reads the file, and if it changed, reparses the kept translation unit
+  // with clang_reparseTranslationUnit and recollects only the functions whose
+  // source changed. Everything else, including branch ids, is reused. Returns
+  // false if the file did not change.
+  bool reanalyze();
+
+  // Long lived session: runs the toolchain once, then watches the file and
+  // reanalyzes, transforms and recompiles it on every change.
+  void executeWatchSession();
+
+  // Runs the non-interactive part of the toolchain: collection, dictionary,
+  // transformation and compilation. Returns true if every step succeeded.
+  bool runToolchain();
+
+  // Was the file read and parsed, or restored from the cache?
+  bool isLoaded() const { return loaded; }
+
   // Return the number of include directives in the file so the sifd can re map lie numbers.
+  // Always 0 when includes are kept, as line numbers are then exact.
   unsigned getNumIncludeDirectives() const {
     return includeDirectives.size();
   }
@@ -0,0 +1,323 @@
+// TraceDecoder.cpp
+// ~~~~~~~~~~~~~~~~
+// Implementation of the TraceDecoder interface.
+#include "TraceDecoder.h"
+#include "Common.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <map>
+#include <unistd.h>
+#include <vector>
+
+ssize_t TraceDecoder::readBlock(int fd, std::string &buffer, size_t filled) {
+  ssize_t bytes;
+  do {
+    bytes = read(fd, &buffer[filled], buffer.size() - filled);
+  } while (bytes < 0 && errno == EINTR);
+  return bytes;
+}
+
+bool TraceDecoder::decode(const TraceCallback &onEvent) const {
+  const int fd = open(tracePath.c_str(), O_RDONLY);
+  if (fd < 0) {
+    std::cerr << "Could not open trace " << tracePath << "!\n";
+    return false;
+  }
+  const bool decoded = decodeBinary(fd, tracePath, onEvent);
+  close(fd);
+  return decoded;
+}
+
+bool TraceDecoder::decode(std::ostream &out) const {
+  return decode([&out](const TraceEvent &event) { writeEvent(event, out); });
+}
+
+bool TraceDecoder::merge(std::ostream &out) const {
+  std::vector<TraceEvent> events;
+  if (!decode(
+          [&events](const TraceEvent &event) { events.push_back(event); })) {
+    return false;
+  }
+  // Each thread's events are already in order, sequence numbers are unique.
+  std::sort(events.begin(), events.end(),
+            [](const TraceEvent &A, const TraceEvent &B) {
+              return A.seq < B.seq;
+            });
+  for (const TraceEvent &event : events) {
+    writeEvent(event, out);
+  }
+  return true;
+}
+
+bool TraceDecoder::estimate(std::ostream &out) const {
+  // Events recorded per thread, per branch id or call address.
+  std::map<std::pair<unsigned, unsigned>, uint64_t> branchHits;
+  std::map<std::pair<unsigned, uint64_t>, uint64_t> funcHits;
+  uint64_t warmup = 0;
+  uint64_t period = 1;
+  if (!decode([&](const TraceEvent &event) {
+        switch (event.kind) {
+        case TraceEvent::Branch:
+          ++branchHits[std::make_pair(event.thread, event.id)];
+          break;
+        case TraceEvent::Func:
+          ++funcHits[std::make_pair(event.thread, event.address)];
+          break;
+        case TraceEvent::Sampling:
+          warmup = event.id;
+          period = event.address;
+          break;
+        }
+      })) {
+    return false;
+  }
+
+  // Warmup hits were all recorded, after that one in every period was.
+  auto scale = [&](uint64_t recorded) {
+    return recorded <= warmup ? recorded
+                              : warmup + (recorded - warmup) * period;
+  };
+  std::map<unsigned, uint64_t> branchCounts;
+  for (const std::pair<const std::pair<unsigned, unsigned>, uint64_t> &hits :
+       branchHits) {
+    branchCounts[hits.first.second] += scale(hits.second);
+  }
+  std::map<uint64_t, uint64_t> funcCounts;
+  for (const std::pair<const std::pair<unsigned, uint64_t>, uint64_t> &hits :
+       funcHits) {
+    funcCounts[hits.first.second] += scale(hits.second);
+  }
+
+  for (const std::pair<const unsigned, uint64_t> &count : branchCounts) {
+    out << BRANCH_ID(count.first) << ": " << count.second << '\n';
+  }
+  for (const std::pair<const uint64_t, uint64_t> &count : funcCounts) {
+    out << "func_0x" << std::hex << count.first << std::dec << ": "
+        << count.second << '\n';
+  }
+  return true;
+}
+
+bool TraceDecoder::decodeBinary(int fd, const std::string &name,
+                                const TraceCallback &onEvent) {
+  // Expanded events are kept in a history so repeat records can be replayed.
+  TraceEvent history[TRACE_HISTORY];
+  uint64_t seen = 0;
+  auto emit = [&](const TraceEvent &event) {
+    onEvent(event);
+    history[seen++ % TRACE_HISTORY] = event;
+  };
+
+  // Read in large blocks, records and block headers may be split across
+  // reads so any partial one is carried over to the next read.
+  std::string buffer(BLOCK_BYTES, '\0');
+  size_t filled = 0;
+  bool headerChecked = false;
+  bool threaded = false;
+  // Thread and remaining records of the current block of a threaded trace.
+  unsigned blockThread = 0;
+  uint32_t blockLeft = 0;
+  for (;;) {
+    const ssize_t bytes = readBlock(fd, buffer, filled);
+    if (bytes < 0) {
+      std::cerr << "Error reading trace " << name << "!\n";
+      return false;
+    }
+    if (bytes == 0) {
+      break;
+    }
+    filled += bytes;
+
+    size_t offset = 0;
+    if (!headerChecked) {
+      uint32_t header[2];
+      if (filled < sizeof(header)) {
+        continue;
+      }
+      memcpy(header, buffer.data(), sizeof(header));
+      if (header[0] == THREADED_TRACE_MAGIC &&
+          header[1] == THREADED_TRACE_VERSION) {
+        threaded = true;
+      } else if (header[0] != TRACE_MAGIC || header[1] != TRACE_VERSION) {
+        std::cerr << name << " is not a KPC trace!\n";
+        return false;
+      }
+      offset = sizeof(header);
+      headerChecked = true;
+    }
+
+    while (threaded) {
+      if (blockLeft == 0) {
+        if (offset + sizeof(TraceBlockHeader) > filled) {
+          break;
+        }
+        TraceBlockHeader block;
+        memcpy(&block, buffer.data() + offset, sizeof(block));
+        blockThread = block.thread;
+        blockLeft = block.count;
+        offset += sizeof(block);
+        continue;
+      }
+      if (offset + sizeof(ThreadedTraceRecord) > filled) {
+        break;
+      }
+      ThreadedTraceRecord record;
+      memcpy(&record, buffer.data() + offset, sizeof(record));
+      TraceEvent::Kind kind;
+      switch (record.kind) {
+      case TRACE_BRANCH:
+        kind = TraceEvent::Branch;
+        break;
+      case TRACE_FUNC:
+        kind = TraceEvent::Func;
+        break;
+      case TRACE_SAMPLING:
+        kind = TraceEvent::Sampling;
+        break;
+      default:
+        std::cerr << name << " has an unknown record kind " << record.kind
+                  << "!\n";
+        return false;
+      }
+      onEvent({kind, record.id, record.ptr, blockThread, record.seq});
+      --blockLeft;
+      offset += sizeof(record);
+    }
+
+    for (; !threaded && offset + sizeof(TraceRecord) <= filled;
+         offset += sizeof(TraceRecord)) {
+      TraceRecord record;
+      memcpy(&record, buffer.data() + offset, sizeof(record));
+      switch (record.kind) {
+      case TRACE_BRANCH:
+        emit({TraceEvent::Branch, record.id, 0, 0, 0});
+        break;
+      case TRACE_FUNC:
+        emit({TraceEvent::Func, record.id, record.ptr, 0, 0});
+        break;
+      case TRACE_SAMPLING:
+        emit({TraceEvent::Sampling, record.id, record.ptr, 0, 0});
+        break;
+      case TRACE_REPEAT: {
+        const unsigned period = record.id;
+        if (period == 0 || period > TRACE_MAX_PERIOD || period > seen) {
+          std::cerr << name << " repeats " << period
+                    << " events it does not have!\n";
+          return false;
+        }
+        for (uint64_t repeat = 0; repeat < record.ptr * period; ++repeat) {
+          emit(history[(seen - period) % TRACE_HISTORY]);
+        }
+        break;
+      }
+      default:
+        std::cerr << name << " has an unknown record kind " << record.kind
+                  << "!\n";
+        return false;
+      }
+    }
+
+    // Carry the partial record over.
+    filled -= offset;
+    memmove(&buffer[0], buffer.data() + offset, filled);
+  }
+
+  if (!headerChecked) {
+    std::cerr << name << " is not a KPC trace!\n";
+    return false;
+  }
+  if (filled != 0 || blockLeft != 0) {
+    std::cerr << name << " ends in a partial record!\n";
+    return false;
+  }
+  return true;
+}
+
+bool TraceDecoder::decodeText(int fd, const TraceCallback &onEvent) {
+  // Parses a complete line, without its newline.
+  auto parseLine = [&onEvent](const char *line, size_t length) {
+    char *end;
+    if (length > 3 && !strncmp(line, "br_", 3)) {
+      const unsigned long id = strtoul(line + 3, &end, 10);
+      if (end == line + length) {
+        onEvent({TraceEvent::Branch, static_cast<unsigned>(id), 0, 0, 0});
+      }
+    } else if (length > 7 && !strncmp(line, "func_0x", 7)) {
+      const unsigned long long address = strtoull(line + 7, &end, 16);
+      if (end == line + length) {
+        onEvent({TraceEvent::Func, 0, address, 0, 0});
+      }
+    } else if (length == 10 && !strncmp(line, "func_(nil)", 10)) {
+      onEvent({TraceEvent::Func, 0, 0, 0, 0});
+    }
+  };
+
+  // Read in large blocks, a line split across reads is carried over. Lines
+  // longer than a block are not trace lines, they are dropped.
+  std::string buffer(BLOCK_BYTES, '\0');
+  size_t filled = 0;
+  bool overlong = false;
+  for (;;) {
+    const ssize_t bytes = readBlock(fd, buffer, filled);
+    if (bytes < 0) {
+      std::cerr << "Error reading trace!\n";
+      return false;
+    }
+    if (bytes == 0) {
+      break;
+    }
+    filled += bytes;
+
+    size_t lineStart = 0;
+    for (const char *newline = static_cast<const char *>(
+             memchr(buffer.data(), '\n', filled));
+         newline != nullptr;
+         newline = static_cast<const char *>(memchr(
+             buffer.data() + lineStart, '\n', filled - lineStart))) {
+      const size_t lineEnd = newline - buffer.data();
+      if (!overlong) {
+        parseLine(buffer.data() + lineStart, lineEnd - lineStart);
+      }
+      overlong = false;
+      lineStart = lineEnd + 1;
+    }
+
+    filled -= lineStart;
+    memmove(&buffer[0], buffer.data() + lineStart, filled);
+    if (filled == buffer.size()) {
+      overlong = true;
+      filled = 0;
+    }
+  }
+  if (filled != 0 && !overlong) {
+    parseLine(buffer.data(), filled);
+  }
+  return true;
+}
+
+void TraceDecoder::writeEvent(const TraceEvent &event, std::ostream &out) {
+  char line[64];
+  int length = 0;
+  if (event.thread != 0) {
+    length = snprintf(line, sizeof(line), "t%u ", event.thread);
+  }
+  if (event.kind == TraceEvent::Branch) {
+    length += snprintf(line + length, sizeof(line) - length, "br_%u\n",
+                       event.id);
+  } else if (event.kind == TraceEvent::Sampling) {
+    length += snprintf(line + length, sizeof(line) - length,
+                       "# sampling warmup %u period %llu\n", event.id,
+                       static_cast<unsigned long long>(event.address));
+  } else {
+    length += snprintf(
+        line + length, sizeof(line) - length, "func_%p\n",
+        reinterpret_cast<void *>(static_cast<uintptr_t>(event.address)));
+  }
+  out.write(line, length);
+}
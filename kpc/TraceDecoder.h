@@ -0,0 +1,89 @@
+// TraceDecoder.h
+// ~~~~~~~~~~~~~~
+// Defines the TraceDecoder interface, used to turn a binary trace written by
+// the trace runtime, or the text a modified program prints, back into trace
+// events.
+#ifndef TRACE_DECODER__H
+#define TRACE_DECODER__H
+
+#include <cstdint>
+#include <functional>
+#include <ostream>
+#include <string>
+#include <sys/types.h>
+
+#include "TraceRuntime.h"
+
+// A single event of a branch pointer trace.
+struct TraceEvent {
+  enum Kind { Branch, Func, Sampling };
+  Kind kind;
+  // Branch id number, e.g. 2 for br_2. For calls, the interned function id
+  // when read from a binary trace, 0 when read from text. For the sampling
+  // event of a sampled trace, the warmup.
+  unsigned id;
+  // Address the call went through, 0 for branches. The sampling period for
+  // the sampling event.
+  uint64_t address;
+  // Thread the event happened on and its global sequence number, only set
+  // for threaded traces, where thread ids start at 1.
+  unsigned thread;
+  uint64_t seq;
+};
+
+// Called for every event, in trace order.
+using TraceCallback = std::function<void(const TraceEvent &)>;
+
+class TraceDecoder {
+
+  // Path of the binary trace.
+  const std::string tracePath;
+
+  // Number of bytes read at once.
+  static constexpr size_t BLOCK_BYTES = 1 << 20;
+
+  // Reads from fd into buffer after the first filled bytes, returning the
+  // number of bytes read, 0 at the end and -1 on error.
+  static ssize_t readBlock(int fd, std::string &buffer, size_t filled);
+
+public:
+  // Decoder for the trace at the given path.
+  explicit TraceDecoder(const std::string &tracePath) : tracePath(tracePath) {}
+
+  // Calls onEvent for every event in the trace file, expanding repeat
+  // records. Returns false if the file is missing, not a trace, or corrupt.
+  bool decode(const TraceCallback &onEvent) const;
+
+  // Writes one 'br_N' or 'func_0x...' line per event, the same text the
+  // printf based LOG and LOG_PTR macros print. Events of a threaded trace are
+  // prefixed with their thread, e.g. 't2 br_4', and come in the order the
+  // threads' buffers were written.
+  bool decode(std::ostream &out) const;
+
+  // Writes the events of a threaded trace like decode(), but ordered by
+  // sequence number across all threads. The whole trace is held in memory.
+  bool merge(std::ostream &out) const;
+
+  // Writes the estimated number of times each branch and call address was
+  // reached, as 'br_N: count' and 'func_0x...: count' lines. Counts of a
+  // sampled trace are scaled back by its warmup and period, counts of an
+  // unsampled trace are exact. Warmups are taken per thread, a sampled binary
+  // trace is scaled as one thread and is only right for single threaded
+  // programs.
+  bool estimate(std::ostream &out) const;
+
+  // Decodes a binary or threaded trace from fd as it is read, so a pipe is
+  // decoded while the program is still writing it. name is only used in
+  // error messages.
+  static bool decodeBinary(int fd, const std::string &name,
+                           const TraceCallback &onEvent);
+
+  // Parses the text trace read from fd as it arrives. Lines which are not
+  // 'br_N' or 'func_0x...', such as the program's own output, are skipped.
+  static bool decodeText(int fd, const TraceCallback &onEvent);
+
+  // Writes an event as its line of text.
+  static void writeEvent(const TraceEvent &event, std::ostream &out);
+};
+
+#endif // TRACE_DECODER__H
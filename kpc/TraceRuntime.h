@@ -0,0 +1,736 @@
+// TraceRuntime.h
+// ~~~~~~~~~~~~~~
+// The binary trace runtime injected into modified programs, and the record
+// layout shared with the trace decoder.
+#ifndef TRACE_RUNTIME__H
+#define TRACE_RUNTIME__H
+
+#include <cstdint>
+
+// Trace files start with the magic and version, followed by records.
+#define TRACE_MAGIC 0x5443504b // 'KPCT'
+#define TRACE_VERSION 2
+
+// Record kinds
+#define TRACE_BRANCH 0
+#define TRACE_FUNC 1
+#define TRACE_REPEAT 2
+#define TRACE_SAMPLING 3
+
+// Longest run of events a repeat record can cover, and the number of
+// expanded events the writer and the decoder keep to match against.
+#define TRACE_MAX_PERIOD 32
+#define TRACE_HISTORY 64
+
+// One fixed width trace record. For branches id is the branch id number and
+// ptr is unused, for calls id is the interned function id and ptr the
+// address the call went through. A repeat record means the last id events
+// of the expanded trace occur ptr more times, so identical consecutive
+// events and loop bodies of up to TRACE_MAX_PERIOD events take one record.
+// A sampling record, written first in sampled traces, holds the warmup in id
+// and the period in ptr.
+struct TraceRecord {
+  uint32_t kind;
+  uint32_t id;
+  uint64_t ptr;
+};
+
+static_assert(sizeof(TraceRecord) == 16, "Trace records are 16 bytes");
+
+// Coverage maps start with the magic, version and number of edges, followed
+// by one byte per edge, indexed by branch id.
+#define COVERAGE_MAGIC 0x4543504b // 'KPCE'
+#define COVERAGE_VERSION 1
+
+// Written after defines for the magic, version, record kinds, period limits
+// and default trace path. Every event is kept in a small history. While
+// events repeat the ones a period back, only a counter is bumped, anything
+// that does not repeat is appended to a buffer that is written to the trace
+// file whenever it fills, and at exit. The buffer and history are shared by
+// all threads, so events of every thread make it into the one trace and
+// repeats are matched against the events as written. Once a second thread
+// exists every event takes a lock, --threaded-trace avoids that. While the
+// C library reports a single thread the lock is skipped. KPC_TRACE_FILE
+// overrides the trace path at run time.
+inline constexpr const char *TRACE_RUNTIME = R"(#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#if defined(__has_include)
+#if __has_include(<sys/single_threaded.h>)
+#include <sys/single_threaded.h>
+#define KPC_SINGLE_THREADED __libc_single_threaded
+#endif
+#endif
+#ifndef KPC_SINGLE_THREADED
+#define KPC_SINGLE_THREADED 0
+#endif
+
+#define KPC_TRACE_RECORDS 4096
+
+struct kpc_record {
+  uint32_t kind;
+  uint32_t id;
+  uint64_t ptr;
+};
+
+static struct kpc_record kpc_buffer[KPC_TRACE_RECORDS];
+static unsigned kpc_used;
+static FILE *kpc_trace;
+static pthread_mutex_t kpc_lock = PTHREAD_MUTEX_INITIALIZER;
+
+#ifdef KPC_SAMPLE_PERIOD
+static void kpc_sample_init(void);
+#endif
+
+/* Last KPC_TRACE_HISTORY events, kpc_seen counts every event ever added.
+   The last kpc_pending of them are not in the buffer yet, they are either
+   part of the current run or still being matched. */
+static struct kpc_record kpc_history[KPC_TRACE_HISTORY];
+static uint64_t kpc_seen;
+static unsigned kpc_pending;
+static unsigned kpc_period;
+static uint64_t kpc_repeats;
+
+static void kpc_flush(void) {
+  if (kpc_used != 0 && kpc_trace != NULL) {
+    fwrite(kpc_buffer, sizeof(struct kpc_record), kpc_used, kpc_trace);
+  }
+  kpc_used = 0;
+}
+
+static inline void kpc_emit(uint32_t kind, uint32_t id, uint64_t ptr) {
+  if (kpc_used == KPC_TRACE_RECORDS) {
+    kpc_flush();
+  }
+  kpc_buffer[kpc_used].kind = kind;
+  kpc_buffer[kpc_used].id = id;
+  kpc_buffer[kpc_used].ptr = ptr;
+  ++kpc_used;
+}
+
+/* Event added back events ago, 1 being the latest. */
+static inline struct kpc_record *kpc_back(unsigned back) {
+  return &kpc_history[(kpc_seen - back) % KPC_TRACE_HISTORY];
+}
+
+static inline int kpc_same(const struct kpc_record *A,
+                           const struct kpc_record *B) {
+  return A->kind == B->kind && A->id == B->id && A->ptr == B->ptr;
+}
+
+/* Writes the finished run, if any, as a repeat record. */
+static void kpc_end_run(void) {
+  if (kpc_repeats != 0) {
+    kpc_emit(KPC_TRACE_REPEAT, kpc_period, kpc_repeats);
+  }
+  kpc_period = 0;
+  kpc_repeats = 0;
+}
+
+/* Looks for the shortest period the pending events repeat with, writing the
+   oldest pending event out until one is found or none are left. */
+static void kpc_find_period(void) {
+  while (kpc_pending != 0) {
+    for (unsigned period = 1; period <= KPC_TRACE_MAX_PERIOD &&
+                              period + kpc_pending <= kpc_seen;
+         ++period) {
+      unsigned back = 1;
+      while (back <= kpc_pending &&
+             kpc_same(kpc_back(back), kpc_back(back + period))) {
+        ++back;
+      }
+      if (back > kpc_pending) {
+        kpc_period = period;
+        kpc_repeats = kpc_pending / period;
+        kpc_pending %= period;
+        return;
+      }
+    }
+    const struct kpc_record *oldest = kpc_back(kpc_pending--);
+    kpc_emit(oldest->kind, oldest->id, oldest->ptr);
+  }
+}
+
+static inline void kpc_add(uint32_t kind, uint32_t id, const void *ptr) {
+  struct kpc_record *event = &kpc_history[kpc_seen % KPC_TRACE_HISTORY];
+  event->kind = kind;
+  event->id = id;
+  event->ptr = (uint64_t)(uintptr_t)ptr;
+  ++kpc_seen;
+  ++kpc_pending;
+
+  /* Common case inside a loop, the event continues the current run. */
+  if (kpc_period != 0) {
+    if (kpc_same(event, kpc_back(kpc_period + 1))) {
+      if (kpc_pending == kpc_period) {
+        ++kpc_repeats;
+        kpc_pending = 0;
+      }
+      return;
+    }
+    kpc_end_run();
+  }
+  kpc_find_period();
+}
+
+static inline void kpc_append(uint32_t kind, uint32_t id, const void *ptr) {
+  if (KPC_SINGLE_THREADED) {
+    kpc_add(kind, id, ptr);
+    return;
+  }
+  pthread_mutex_lock(&kpc_lock);
+  kpc_add(kind, id, ptr);
+  pthread_mutex_unlock(&kpc_lock);
+}
+
+/* Threads still running at exit may log more events, those are dropped. */
+static void kpc_close(void) {
+  pthread_mutex_lock(&kpc_lock);
+  kpc_end_run();
+  while (kpc_pending != 0) {
+    const struct kpc_record *oldest = kpc_back(kpc_pending--);
+    kpc_emit(oldest->kind, oldest->id, oldest->ptr);
+  }
+  kpc_flush();
+  if (kpc_trace != NULL) {
+    fclose(kpc_trace);
+    kpc_trace = NULL;
+  }
+  pthread_mutex_unlock(&kpc_lock);
+}
+
+__attribute__((constructor)) static void kpc_open(void) {
+  const char *path = getenv("KPC_TRACE_FILE");
+  kpc_trace = fopen(path != NULL ? path : KPC_TRACE_DEFAULT, "wb");
+  if (kpc_trace != NULL) {
+    const uint32_t header[2] = {KPC_TRACE_MAGIC, KPC_TRACE_VERSION};
+    fwrite(header, sizeof(header), 1, kpc_trace);
+    atexit(kpc_close);
+#ifdef KPC_SAMPLE_PERIOD
+    kpc_sample_init();
+#endif
+  }
+}
+
+#define LOG(BP) kpc_append(KPC_TRACE_BRANCH, BP, NULL);
+#define LOG_FUNC(ID, PTR) kpc_append(KPC_TRACE_FUNC, ID, (const void *)PTR);
+)";
+
+// Threaded traces start with their own magic and version, followed by blocks
+// of records, each one thread's buffer as it was flushed.
+#define THREADED_TRACE_MAGIC 0x4d43504b // 'KPCM'
+#define THREADED_TRACE_VERSION 1
+
+// Precedes the count records of one block, thread ids start at 1.
+struct TraceBlockHeader {
+  uint32_t thread;
+  uint32_t count;
+};
+
+// A record of a threaded trace, seq orders the events of all threads. There
+// are no repeat records, as repeated events each need their own seq.
+struct ThreadedTraceRecord {
+  uint32_t kind;
+  uint32_t id;
+  uint64_t ptr;
+  uint64_t seq;
+};
+
+static_assert(sizeof(ThreadedTraceRecord) == 24,
+              "Threaded trace records are 24 bytes");
+
+// Runtime for threaded traces, written after the same defines as
+// TRACE_RUNTIME. Threads never share a buffer, a thread takes an id on its
+// first event and its buffer is written as one block, with a single fwrite,
+// whenever it fills, when the thread exits and at exit. The only state
+// shared per event is the relaxed atomic sequence counter, blocks are
+// written under a lock that also closes the file.
+inline constexpr const char *THREADED_RUNTIME = R"(#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define KPC_TRACE_RECORDS 2048
+
+struct kpc_record {
+  uint32_t kind;
+  uint32_t id;
+  uint64_t ptr;
+  uint64_t seq;
+};
+
+struct kpc_block {
+  uint32_t thread;
+  uint32_t count;
+  struct kpc_record records[KPC_TRACE_RECORDS];
+};
+
+static _Thread_local struct kpc_block kpc_block;
+static FILE *kpc_trace;
+
+#ifdef KPC_SAMPLE_PERIOD
+static void kpc_sample_init(void);
+#endif
+static pthread_key_t kpc_thread_key;
+static atomic_uint kpc_next_thread = 1;
+static atomic_uint_least64_t kpc_next_seq;
+/* Other threads may still be flushing while exit closes the file. kpc_close
+   waits for their writes, and blocks flushed after it are dropped. */
+static pthread_mutex_t kpc_trace_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Writes the thread's block, with kpc_trace_lock held. */
+static void kpc_write_block(void) {
+  if (kpc_block.count != 0 && kpc_trace != NULL) {
+    fwrite(&kpc_block,
+           offsetof(struct kpc_block, records) +
+               kpc_block.count * sizeof(struct kpc_record),
+           1, kpc_trace);
+  }
+  kpc_block.count = 0;
+}
+
+static void kpc_flush(void) {
+  pthread_mutex_lock(&kpc_trace_lock);
+  kpc_write_block();
+  pthread_mutex_unlock(&kpc_trace_lock);
+}
+
+static void kpc_thread_exit(void *block) {
+  (void)block;
+  kpc_flush();
+}
+
+static inline void kpc_append(uint32_t kind, uint32_t id, const void *ptr) {
+  if (kpc_block.thread == 0) {
+    kpc_block.thread =
+        atomic_fetch_add_explicit(&kpc_next_thread, 1, memory_order_relaxed);
+    /* Any non NULL value, so kpc_thread_exit runs when the thread exits. */
+    pthread_setspecific(kpc_thread_key, &kpc_block);
+  }
+  if (kpc_block.count == KPC_TRACE_RECORDS) {
+    kpc_flush();
+  }
+  struct kpc_record *record = &kpc_block.records[kpc_block.count++];
+  record->kind = kind;
+  record->id = id;
+  record->ptr = (uint64_t)(uintptr_t)ptr;
+  record->seq =
+      atomic_fetch_add_explicit(&kpc_next_seq, 1, memory_order_relaxed);
+}
+
+static void kpc_close(void) {
+  pthread_mutex_lock(&kpc_trace_lock);
+  kpc_write_block();
+  if (kpc_trace != NULL) {
+    fclose(kpc_trace);
+    kpc_trace = NULL;
+  }
+  pthread_mutex_unlock(&kpc_trace_lock);
+}
+
+__attribute__((constructor)) static void kpc_open(void) {
+  const char *path = getenv("KPC_TRACE_FILE");
+  kpc_trace = fopen(path != NULL ? path : KPC_TRACE_DEFAULT, "wb");
+  if (kpc_trace != NULL) {
+    const uint32_t header[2] = {KPC_TRACE_MAGIC, KPC_TRACE_VERSION};
+    fwrite(header, sizeof(header), 1, kpc_trace);
+    pthread_key_create(&kpc_thread_key, kpc_thread_exit);
+    atexit(kpc_close);
+#ifdef KPC_SAMPLE_PERIOD
+    kpc_sample_init();
+#endif
+  }
+}
+
+#define LOG(BP) kpc_append(KPC_TRACE_BRANCH, BP, NULL);
+#define LOG_FUNC(ID, PTR) kpc_append(KPC_TRACE_FUNC, ID, (const void *)PTR);
+)";
+
+// Sampling layer written after TRACE_RUNTIME or THREADED_RUNTIME, after
+// defines for the default warmup and period and the number of branch ids and
+// functions. The first warmup hits of every branch and function, per thread,
+// are recorded, after that only every period-th. KPC_SAMPLE_WARMUP and
+// KPC_SAMPLE_PERIOD override the defaults at run time, the values used are
+// recorded in the trace so counts can be scaled back.
+inline constexpr const char *SAMPLING_RUNTIME = R"(
+static uint32_t kpc_sample_warmup = KPC_SAMPLE_WARMUP;
+static uint32_t kpc_sample_period = KPC_SAMPLE_PERIOD;
+static _Thread_local uint32_t kpc_branch_hits[KPC_BRANCHES];
+static _Thread_local uint32_t kpc_branch_countdown[KPC_BRANCHES];
+static _Thread_local uint32_t kpc_func_hits[KPC_FUNCS];
+static _Thread_local uint32_t kpc_func_countdown[KPC_FUNCS];
+
+static void kpc_sample_init(void) {
+  const char *warmup = getenv("KPC_SAMPLE_WARMUP");
+  const char *period = getenv("KPC_SAMPLE_PERIOD");
+  if (warmup != NULL) {
+    kpc_sample_warmup = (uint32_t)atoi(warmup);
+  }
+  if (period != NULL && atoi(period) > 0) {
+    kpc_sample_period = (uint32_t)atoi(period);
+  }
+  kpc_append(KPC_TRACE_SAMPLING, kpc_sample_warmup,
+             (const void *)(uintptr_t)kpc_sample_period);
+}
+
+static inline int kpc_sample(uint32_t *hits, uint32_t *countdown) {
+  if (*hits < kpc_sample_warmup) {
+    ++*hits;
+    return 1;
+  }
+  if (*countdown == 0) {
+    *countdown = kpc_sample_period - 1;
+    return 1;
+  }
+  --*countdown;
+  return 0;
+}
+
+#undef LOG
+#undef LOG_FUNC
+#define LOG(BP)                                                                \
+  {                                                                            \
+    if (kpc_sample(&kpc_branch_hits[BP], &kpc_branch_countdown[BP]))           \
+      kpc_append(KPC_TRACE_BRANCH, BP, NULL);                                  \
+  }
+#define LOG_FUNC(ID, PTR)                                                      \
+  {                                                                            \
+    if (kpc_sample(&kpc_func_hits[ID], &kpc_func_countdown[ID]))               \
+      kpc_append(KPC_TRACE_FUNC, ID, (const void *)PTR);                       \
+  }
+)";
+
+// Runtime for counter mode, written after defines for the number of branch
+// ids and functions, the function names, and the default counts path. Each
+// event is a single increment, the non zero counts are written once at exit
+// as 'br_N: count' and 'name: count' lines.
+inline constexpr const char *COUNTER_RUNTIME = R"(#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+static uint64_t kpc_branch_counts[KPC_BRANCHES];
+static uint64_t kpc_func_counts[KPC_FUNCS];
+
+static void kpc_dump_counts(void) {
+  const char *path = getenv("KPC_TRACE_FILE");
+  FILE *counts = fopen(path != NULL ? path : KPC_TRACE_DEFAULT, "w");
+  if (counts == NULL) {
+    return;
+  }
+  for (unsigned id = 0; id < KPC_BRANCHES; ++id) {
+    if (kpc_branch_counts[id] != 0) {
+      fprintf(counts, "br_%u: %llu\n", id,
+              (unsigned long long)kpc_branch_counts[id]);
+    }
+  }
+  for (unsigned id = 0; id < KPC_FUNCS; ++id) {
+    if (kpc_func_counts[id] != 0) {
+      fprintf(counts, "%s: %llu\n", kpc_func_names[id],
+              (unsigned long long)kpc_func_counts[id]);
+    }
+  }
+  fclose(counts);
+}
+
+__attribute__((constructor)) static void kpc_register_counts(void) {
+  atexit(kpc_dump_counts);
+}
+
+#define LOG(BP) ++kpc_branch_counts[BP];
+#define LOG_FUNC(ID, PTR) ++kpc_func_counts[ID];
+)";
+
+// Runtime for in-process runs, written after defines for the branch and call
+// record kinds. The modified program is built as a shared object with main
+// renamed to kpc_main and exit to kpc_exit_program, and kpc calls kpc_run(),
+// from IN_PROCESS_MAIN, with a callback that receives every event. exit()
+// jumps back out of kpc_run() instead of ending kpc.
+inline constexpr const char *IN_PROCESS_RUNTIME = R"(#include <setjmp.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+typedef void (*kpc_event_fn)(void *context, unsigned kind, unsigned id,
+                             const void *ptr);
+
+static kpc_event_fn kpc_on_event;
+static void *kpc_event_context;
+static jmp_buf kpc_exit_jump;
+static int kpc_exit_status;
+
+/* Defined with kpc_run, after the profile runtime. */
+void kpc_exit_program(int status);
+
+#define LOG(BP) kpc_on_event(kpc_event_context, KPC_TRACE_BRANCH, BP, NULL);
+#define LOG_FUNC(ID, PTR)                                                      \
+  kpc_on_event(kpc_event_context, KPC_TRACE_FUNC, ID, (const void *)PTR);
+)";
+
+// Entry point for in-process runs, written at the end of the modified program
+// so kpc_main is defined by then. main is called with the parameters it was
+// declared with, int main(void) gets none and int main(int, char **) a one
+// element argv. _Generic picks the form, and main is only ever called through
+// a pointer of its own type.
+inline constexpr const char *IN_PROCESS_MAIN = R"(#ifdef KPC_TRACE
+void kpc_exit_program(int status) {
+#ifdef KPC_PROFILE_DEFAULT
+  /* The jump skips the exit probes of the open frames, end them while they
+     are still on the stack rather than leave kpc_profile_top dangling. */
+  while (kpc_profile_top != NULL) {
+    kpc_exit(kpc_profile_top);
+  }
+#endif
+  kpc_exit_status = status;
+  longjmp(kpc_exit_jump, 1);
+}
+
+typedef void (*kpc_main_fn)(void);
+
+static int kpc_call_main(kpc_main_fn main_fn, int takes_args, int argc,
+                         char **argv) {
+  return takes_args ? ((int (*)(int, char **))main_fn)(argc, argv)
+                    : ((int (*)(void))main_fn)();
+}
+
+#define KPC_CALL_MAIN(ARGC, ARGV)                                              \
+  kpc_call_main((kpc_main_fn)kpc_main,                                         \
+                _Generic(&kpc_main, int (*)(void): 0, default: 1), ARGC, ARGV)
+
+int kpc_run(kpc_event_fn onEvent, void *context) {
+  static char name[] = "kpc";
+  char *argv[] = {name, NULL};
+  kpc_on_event = onEvent;
+  kpc_event_context = context;
+  if (setjmp(kpc_exit_jump) == 0) {
+    kpc_exit_status = KPC_CALL_MAIN(1, argv);
+  }
+  fflush(stdout);
+  return kpc_exit_status;
+}
+#endif
+)";
+
+// Runtime for coverage mode, written after defines for the number of branch
+// ids, the coverage magic and version, and the default map path. Every edge
+// of the branch dictionary, a branch point and one of its targets, has a byte
+// in the map indexed by its branch id, bumped with a saturating add. When
+// KPC_COVERAGE_SHM holds a System V shared memory id the map lives there, so
+// a harness running many inputs reads it without any file being written.
+// Otherwise the hit counts are bucketed AFL style, one bit per bucket so maps
+// merge with a bitwise or, and written at exit. KPC_TRACE_FILE overrides the
+// map path at run time.
+inline constexpr const char *COVERAGE_RUNTIME = R"(#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/shm.h>
+
+static uint8_t kpc_coverage_local[KPC_BRANCHES];
+static uint8_t *kpc_coverage = kpc_coverage_local;
+
+static uint8_t kpc_bucket(uint8_t hits) {
+  if (hits <= 2) {
+    return hits;
+  }
+  if (hits == 3) {
+    return 4;
+  }
+  if (hits < 8) {
+    return 8;
+  }
+  if (hits < 16) {
+    return 16;
+  }
+  if (hits < 32) {
+    return 32;
+  }
+  return hits < 128 ? 64 : 128;
+}
+
+static void kpc_dump_coverage(void) {
+  const char *path = getenv("KPC_TRACE_FILE");
+  FILE *map = fopen(path != NULL ? path : KPC_TRACE_DEFAULT, "wb");
+  if (map == NULL) {
+    return;
+  }
+  const uint32_t header[3] = {KPC_COVERAGE_MAGIC, KPC_COVERAGE_VERSION,
+                              KPC_BRANCHES};
+  fwrite(header, sizeof(header), 1, map);
+  for (unsigned id = 0; id < KPC_BRANCHES; ++id) {
+    kpc_coverage[id] = kpc_bucket(kpc_coverage[id]);
+  }
+  fwrite(kpc_coverage, 1, KPC_BRANCHES, map);
+  fclose(map);
+}
+
+__attribute__((constructor)) static void kpc_open_coverage(void) {
+  const char *shm = getenv("KPC_COVERAGE_SHM");
+  if (shm != NULL) {
+    /* Every edge is written through the segment, one smaller than the map
+       is not used and the map goes to the file instead. */
+    const int id = atoi(shm);
+    struct shmid_ds segment;
+    if (shmctl(id, IPC_STAT, &segment) == 0 &&
+        segment.shm_segsz >= KPC_BRANCHES) {
+      void *shared = shmat(id, NULL, 0);
+      if (shared != (void *)-1) {
+        kpc_coverage = (uint8_t *)shared;
+        return;
+      }
+    } else {
+      fprintf(stderr,
+              "KPC_COVERAGE_SHM %s is not a segment of at least %u bytes, "
+              "writing the coverage map to a file\n",
+              shm, (unsigned)KPC_BRANCHES);
+    }
+  }
+  atexit(kpc_dump_coverage);
+}
+
+#define LOG(BP) kpc_coverage[BP] += kpc_coverage[BP] != 255;
+#define LOG_FUNC(ID, PTR)
+)";
+
+// Runtime for function profiling, written after the trace runtime of the
+// selected format, after defines for the number of functions, the function
+// names and the default profile path. Every instrumented function declares a
+// frame on entry whose cleanup runs on every return, frames link to their
+// caller's so exclusive time is inclusive time minus the callees'. Ticks are
+// read with rdtsc on x86, clock_gettime elsewhere, and converted to
+// nanoseconds by comparing against the clock at start and exit. The flat
+// profile is written at exit, KPC_PROFILE_FILE overrides its path.
+inline constexpr const char *PROFILE_RUNTIME = R"(#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#ifdef CLOCK_MONOTONIC_RAW
+#define KPC_CLOCK CLOCK_MONOTONIC_RAW
+#else
+#define KPC_CLOCK CLOCK_MONOTONIC
+#endif
+
+#ifdef KPC_PROFILE_ATOMIC
+#define KPC_PROFILE_ADD(TOTAL, VALUE)                                          \
+  __atomic_fetch_add(&(TOTAL), VALUE, __ATOMIC_RELAXED)
+#else
+#define KPC_PROFILE_ADD(TOTAL, VALUE) (TOTAL) += (VALUE)
+#endif
+
+struct kpc_frame {
+  uint64_t start;
+  uint64_t children;
+  struct kpc_frame *parent;
+  unsigned id;
+};
+
+static uint64_t kpc_profile_calls[KPC_FUNCS];
+static uint64_t kpc_profile_inclusive[KPC_FUNCS];
+static uint64_t kpc_profile_exclusive[KPC_FUNCS];
+static _Thread_local uint32_t kpc_profile_active[KPC_FUNCS];
+static _Thread_local struct kpc_frame *kpc_profile_top;
+static uint64_t kpc_profile_start_ticks;
+static uint64_t kpc_profile_start_ns;
+
+static uint64_t kpc_ns(void) {
+  struct timespec now;
+  clock_gettime(KPC_CLOCK, &now);
+  return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+}
+
+/* In optimized builds, keeps the compiler from moving the function's own
+   loads and stores across a probe, without forcing anything else out of
+   registers. */
+#ifdef __OPTIMIZE__
+#define KPC_BARRIER() __asm__ __volatile__("" ::: "memory")
+#else
+#define KPC_BARRIER()
+#endif
+
+static inline uint64_t kpc_ticks(void) {
+  KPC_BARRIER();
+#if defined(__x86_64__) || defined(__i386__)
+  const uint64_t ticks = __builtin_ia32_rdtsc();
+#else
+  const uint64_t ticks = kpc_ns();
+#endif
+  KPC_BARRIER();
+  return ticks;
+}
+
+static inline void kpc_enter(struct kpc_frame *frame, unsigned id) {
+  frame->children = 0;
+  frame->parent = kpc_profile_top;
+  frame->id = id;
+  kpc_profile_top = frame;
+  ++kpc_profile_active[id];
+  frame->start = kpc_ticks();
+}
+
+static inline void kpc_exit(struct kpc_frame *frame) {
+  const uint64_t elapsed = kpc_ticks() - frame->start;
+  kpc_profile_top = frame->parent;
+  if (frame->parent != NULL) {
+    frame->parent->children += elapsed;
+  }
+  KPC_PROFILE_ADD(kpc_profile_calls[frame->id], 1);
+  KPC_PROFILE_ADD(kpc_profile_exclusive[frame->id], elapsed - frame->children);
+  /* Recursive calls are already inside the outermost call's time. */
+  if (--kpc_profile_active[frame->id] == 0) {
+    KPC_PROFILE_ADD(kpc_profile_inclusive[frame->id], elapsed);
+  }
+}
+
+static int kpc_by_exclusive(const void *A, const void *B) {
+  const uint64_t a = kpc_profile_exclusive[*(const unsigned *)A];
+  const uint64_t b = kpc_profile_exclusive[*(const unsigned *)B];
+  return a < b ? 1 : a > b ? -1 : 0;
+}
+
+static void kpc_dump_profile(void) {
+  /* Frames still open when exit() is called end here. */
+  while (kpc_profile_top != NULL) {
+    kpc_exit(kpc_profile_top);
+  }
+  const uint64_t ticks = kpc_ticks() - kpc_profile_start_ticks;
+  const uint64_t ns = kpc_ns() - kpc_profile_start_ns;
+  const double msPerTick = ticks != 0 ? ns / 1e6 / ticks : 0;
+
+  const char *path = getenv("KPC_PROFILE_FILE");
+  FILE *profile = fopen(path != NULL ? path : KPC_PROFILE_DEFAULT, "w");
+  if (profile == NULL) {
+    return;
+  }
+  static unsigned order[KPC_FUNCS];
+  uint64_t total = 0;
+  for (unsigned id = 0; id < KPC_FUNCS; ++id) {
+    order[id] = id;
+    total += kpc_profile_exclusive[id];
+  }
+  qsort(order, KPC_FUNCS, sizeof(order[0]), kpc_by_exclusive);
+  fprintf(profile, "%7s %11s %11s %11s  %s\n", "self %", "self ms",
+          "total ms", "calls", "name");
+  for (unsigned rank = 0; rank < KPC_FUNCS; ++rank) {
+    const unsigned id = order[rank];
+    if (kpc_profile_calls[id] == 0) {
+      continue;
+    }
+    fprintf(profile, "%7.2f %11.3f %11.3f %11llu  %s\n",
+            total != 0 ? 100.0 * kpc_profile_exclusive[id] / total : 0,
+            kpc_profile_exclusive[id] * msPerTick,
+            kpc_profile_inclusive[id] * msPerTick,
+            (unsigned long long)kpc_profile_calls[id], kpc_func_names[id]);
+  }
+  fclose(profile);
+}
+
+__attribute__((constructor)) static void kpc_register_profile(void) {
+  kpc_profile_start_ns = kpc_ns();
+  kpc_profile_start_ticks = kpc_ticks();
+  atexit(kpc_dump_profile);
+}
+)";
+
+#endif // TRACE_RUNTIME__H
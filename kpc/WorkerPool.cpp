@@ -0,0 +1,73 @@
+// WorkerPool.cpp
+// ~~~~~~~~~~~~~~
+// Implementation of WorkerPool interface.
+#include "WorkerPool.h"
+
+// Ctor Implementation
+WorkerPool::WorkerPool(unsigned numWorkers) : nextQueue(0), pendingTasks(0) {
+  if (numWorkers == 0) {
+    numWorkers = std::thread::hardware_concurrency();
+  }
+  if (numWorkers == 0) {
+    numWorkers = 1;
+  }
+  for (unsigned idx = 0; idx < numWorkers; ++idx) {
+    queues.push_back(std::make_unique<WorkQueue>());
+  }
+}
+
+void WorkerPool::submit(Task task) {
+  WorkQueue &queue = *queues[nextQueue];
+  nextQueue = (nextQueue + 1) % queues.size();
+  std::lock_guard<std::mutex> guard(queue.lock);
+  queue.tasks.push_back(std::move(task));
+  ++pendingTasks;
+}
+
+bool WorkerPool::getTask(unsigned workerId, Task &task) {
+  // Own queue first, newest task.
+  {
+    WorkQueue &own = *queues[workerId];
+    std::lock_guard<std::mutex> guard(own.lock);
+    if (!own.tasks.empty()) {
+      task = std::move(own.tasks.back());
+      own.tasks.pop_back();
+      return true;
+    }
+  }
+
+  // Then steal the oldest task from the other workers.
+  for (unsigned offset = 1; offset < queues.size(); ++offset) {
+    WorkQueue &victim = *queues[(workerId + offset) % queues.size()];
+    std::lock_guard<std::mutex> guard(victim.lock);
+    if (!victim.tasks.empty()) {
+      task = std::move(victim.tasks.front());
+      victim.tasks.pop_front();
+      return true;
+    }
+  }
+  return false;
+}
+
+void WorkerPool::workerLoop(unsigned workerId) {
+  Task task;
+  // Tasks are never submitted while running, so once every queue is empty
+  // there is nothing left for this worker to do.
+  while (pendingTasks.load() > 0) {
+    if (!getTask(workerId, task)) {
+      break;
+    }
+    task(workerId);
+    --pendingTasks;
+  }
+}
+
+void WorkerPool::run() {
+  for (unsigned workerId = 0; workerId < queues.size(); ++workerId) {
+    workers.emplace_back(&WorkerPool::workerLoop, this, workerId);
+  }
+  for (std::thread &worker : workers) {
+    worker.join();
+  }
+  workers.clear();
+}
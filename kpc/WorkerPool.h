@@ -0,0 +1,62 @@
+// WorkerPool.h
+// ~~~~~~~~~~~~
+// Defines a small work-stealing thread pool used to analyze many translation
+// units at once.
+#ifndef WORKER_POOL__H
+#define WORKER_POOL__H
+
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class WorkerPool {
+public:
+  // A task receives the id of the worker running it, so callers can keep
+  // per-worker resources (e.g. one CXIndex per worker).
+  using Task = std::function<void(unsigned workerId)>;
+
+private:
+  // Each worker owns a deque, it pops from the back of its own and steals
+  // from the front of the others once it runs dry.
+  struct WorkQueue {
+    std::mutex lock;
+    std::deque<Task> tasks;
+  };
+
+  // Per worker queues.
+  std::vector<std::unique_ptr<WorkQueue>> queues;
+
+  // Worker threads, only alive during run().
+  std::vector<std::thread> workers;
+
+  // Next queue a submitted task is placed in.
+  unsigned nextQueue;
+
+  // Tasks submitted but not yet finished.
+  std::atomic<size_t> pendingTasks;
+
+  // Pops a task from the workers own queue, or steals one from another.
+  bool getTask(unsigned workerId, Task &task);
+
+  // Main loop of each worker thread.
+  void workerLoop(unsigned workerId);
+
+public:
+  // Pool ctor, a worker count of 0 uses the hardware concurrency.
+  explicit WorkerPool(unsigned numWorkers = 0);
+
+  // Number of workers in the pool.
+  unsigned size() const { return queues.size(); }
+
+  // Adds a task, tasks are spread round robin over the worker queues.
+  void submit(Task task);
+
+  // Runs all submitted tasks to completion, blocking until done.
+  void run();
+};
+
+#endif // WORKER_POOL__H
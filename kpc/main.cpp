@@ -1,14 +1,208 @@
 // main.cpp
 // ~~~~~~~~
 // Main execution for the KPC
+#include "BatchCollector.h"
+#include "CoverageMap.h"
 #include "KeyPointsCollector.h"
+#include "TraceDecoder.h"
 
 #include <cassert>
+#include <cerrno>
+#include <cstdlib>
 #include <fstream>
 #include <iostream>
+#include <limits>
+#include <set>
+
+// Parses a non-negative count given to an option. Prints an error and
+// returns false if the value is not a number.
+static bool parseCount(const std::string &option, const char *value,
+                       unsigned *count) {
+  char *end;
+  errno = 0;
+  const unsigned long parsed = std::strtoul(value, &end, 10);
+  if (*value == '\0' || *value == '-' || *end != '\0' || errno == ERANGE ||
+      parsed > std::numeric_limits<unsigned>::max()) {
+    std::cerr << "Invalid value for " << option << ": " << value
+              << ", expected a non-negative number!\n";
+    return false;
+  }
+  *count = static_cast<unsigned>(parsed);
+  return true;
+}
+
+// Checks that an option is followed by the values it takes. Prints an error
+// and returns false if the command line ends before them.
+static bool hasValues(const std::string &option, int arg, int argc,
+                      int values = 1) {
+  if (arg + values < argc) {
+    return true;
+  }
+  std::cerr << "Missing value for " << option << "!\n";
+  return false;
+}
 
 int main(int argc, char *argv[]) {
 
+  // Parse command line options
+  KPCOptions options;
+  std::string batchPath;
+  std::string decodePath;
+  std::string mergePath;
+  std::string estimatePath;
+  std::vector<std::string> coveragePaths;
+  unsigned jobs = 0;
+  bool watch = false;
+  for (int arg = 1; arg < argc; ++arg) {
+    const std::string option(argv[arg]);
+    if (!option.compare("--debug")) {
+      options.debug = true;
+    } else if (!option.compare("--keep-includes")) {
+      options.keepIncludes = true;
+    } else if (!option.compare("--no-cache")) {
+      options.useCache = false;
+    } else if (!option.compare("--binary-trace")) {
+      options.traceFormat = TraceFormat::Binary;
+    } else if (!option.compare("--counters")) {
+      options.traceFormat = TraceFormat::Counters;
+    } else if (!option.compare("--threaded-trace")) {
+      options.traceFormat = TraceFormat::Threaded;
+    } else if (!option.compare("--coverage")) {
+      options.traceFormat = TraceFormat::Coverage;
+    } else if (!option.compare("--merge-coverage")) {
+      if (!hasValues(option, arg, argc, 2)) {
+        return EXIT_FAILURE;
+      }
+      // The merged map, then every map to merge into it.
+      coveragePaths.assign(argv + arg + 1, argv + argc);
+      break;
+    } else if (!option.compare("--attribute")) {
+      options.attributeCosts = true;
+    } else if (!option.compare("--concurrent-build")) {
+      options.concurrentBuild = true;
+    } else if (!option.compare("--in-process")) {
+      options.inProcess = true;
+    } else if (!option.compare("--opt-level")) {
+      if (!hasValues(option, arg, argc)) {
+        return EXIT_FAILURE;
+      }
+      options.optLevel = argv[++arg];
+      // Given to the compiler as -O<level>.
+      const std::set<std::string> optLevels{"0", "1", "2", "3",
+                                            "s", "fast", "g"};
+      if (optLevels.count(options.optLevel) == 0) {
+        std::cerr << "Invalid value for " << option << ": "
+                  << options.optLevel
+                  << ", expected one of 0, 1, 2, 3, s, fast or g!\n";
+        return EXIT_FAILURE;
+      }
+    } else if (!option.compare("--compare-opt-levels")) {
+      options.compareOptLevels = true;
+    } else if (!option.compare("--profile")) {
+      options.profile = true;
+    } else if (!option.compare("--sample")) {
+      if (!hasValues(option, arg, argc) ||
+          !parseCount(option, argv[++arg], &options.samplePeriod)) {
+        return EXIT_FAILURE;
+      }
+    } else if (!option.compare("--sample-warmup")) {
+      if (!hasValues(option, arg, argc) ||
+          !parseCount(option, argv[++arg], &options.sampleWarmup)) {
+        return EXIT_FAILURE;
+      }
+    } else if (!option.compare("--estimate")) {
+      if (!hasValues(option, arg, argc)) {
+        return EXIT_FAILURE;
+      }
+      estimatePath = argv[++arg];
+    } else if (!option.compare("--merge")) {
+      if (!hasValues(option, arg, argc)) {
+        return EXIT_FAILURE;
+      }
+      mergePath = argv[++arg];
+    } else if (!option.compare("--decode")) {
+      if (!hasValues(option, arg, argc)) {
+        return EXIT_FAILURE;
+      }
+      decodePath = argv[++arg];
+    } else if (!option.compare("--watch")) {
+      watch = true;
+    } else if (!option.compare("--batch")) {
+      if (!hasValues(option, arg, argc)) {
+        return EXIT_FAILURE;
+      }
+      batchPath = argv[++arg];
+    } else if (!option.compare("--jobs") || !option.compare("-j")) {
+      if (!hasValues(option, arg, argc) ||
+          !parseCount(option, argv[++arg], &jobs)) {
+        return EXIT_FAILURE;
+      }
+    }
+  }
+
+  // Decode a binary trace to stdout.
+  if (!decodePath.empty()) {
+    return TraceDecoder(decodePath).decode(std::cout) ? EXIT_SUCCESS
+                                                      : EXIT_FAILURE;
+  }
+
+  // Merge a threaded trace into one, in the order events happened.
+  if (!mergePath.empty()) {
+    return TraceDecoder(mergePath).merge(std::cout) ? EXIT_SUCCESS
+                                                    : EXIT_FAILURE;
+  }
+
+  // Estimate how often each branch and call was reached from a trace.
+  if (!estimatePath.empty()) {
+    return TraceDecoder(estimatePath).estimate(std::cout) ? EXIT_SUCCESS
+                                                          : EXIT_FAILURE;
+  }
+
+  // Merge coverage maps of many runs into one.
+  if (!coveragePaths.empty()) {
+    CoverageMap merged;
+    for (size_t map = 1; map < coveragePaths.size(); ++map) {
+      CoverageMap coverage;
+      if (!coverage.load(coveragePaths[map]) || !merged.merge(coverage)) {
+        return EXIT_FAILURE;
+      }
+    }
+    std::cout << merged.edgesCovered() << " of " << merged.edges()
+              << " edges covered\n";
+    return merged.save(coveragePaths[0]) ? EXIT_SUCCESS : EXIT_FAILURE;
+  }
+
+  // Sampling needs a binary trace, use the buffered one unless another was
+  // asked for.
+  if (options.samplePeriod != 0 &&
+      options.traceFormat == TraceFormat::Text) {
+    options.traceFormat = TraceFormat::Binary;
+  }
+  if (options.samplePeriod != 0 &&
+      options.traceFormat == TraceFormat::Binary) {
+    std::cout << "Sampled binary traces are estimated as a single thread, "
+                 "pass --threaded-trace for multithreaded programs.\n";
+  }
+
+  // In-process runs hand over numbered events like a binary trace, and do
+  // not sample or buffer per thread.
+  if (options.inProcess) {
+    if (options.traceFormat == TraceFormat::Text) {
+      options.traceFormat = TraceFormat::Binary;
+    }
+    if (options.traceFormat != TraceFormat::Binary ||
+        options.samplePeriod != 0) {
+      std::cerr << "--in-process only records plain, unsampled traces!\n";
+      return EXIT_FAILURE;
+    }
+  }
+
+  // Batch mode, no prompts, analyze every file in the project.
+  if (!batchPath.empty()) {
+    BatchCollector batch(batchPath, options, jobs);
+    return batch.run() == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+  }
+
   // Get filename
   std::string filename;
   std::cout << "Enter a file name for analysis: ";
@@ -21,7 +215,13 @@ int main(int argc, char *argv[]) {
   }
 
   // Init the KPC
-  KeyPointsCollector kpc(
-      filename, (argc > 2 && !std::string(argv[2]).compare("--debug")));
-  kpc.executeToolchain();
+  KeyPointsCollector kpc(filename, options);
+  if (!kpc.isLoaded()) {
+    exit(EXIT_FAILURE);
+  }
+  if (watch) {
+    kpc.executeWatchSession();
+  } else {
+    kpc.executeToolchain();
+  }
 }
@@ -0,0 +1,37 @@
+#!/bin/bash
+# Regression checks for kpc, run from the repository root with make test.
+# Each check runs kpc and compares what it wrote with an expected file in
+# tests/.
+KPC=${KPC:-bin/kpc}
+status=0
+
+# Compare the expected file $2 with the output $3, named $1 in the report.
+check() {
+  if diff -u "$2" "$3"; then
+    echo "PASS: $1"
+  else
+    echo "FAIL: $1"
+    status=1
+  fi
+}
+
+# TF_1 has a while loop at the end of initialize_array and one at the end of
+# main. Neither may take a target from the next function, and main's loop
+# must not be dropped.
+rm -f out/TF_1_fib.c.branch_dict
+printf 'TF_1_fib.c\nn\nn\n' | $KPC --no-cache > /dev/null
+check "TF_1_fib.c branch dictionary" tests/TF_1_fib.branch_dict \
+  out/TF_1_fib.c.branch_dict
+
+# A batch over the working directory must not pick up the formatted and
+# modified copies an earlier run left in out/.
+project=$(mktemp -d)
+cp TF_1_fib.c TF_2_funcall.c "$project"
+kpc=$(realpath "$KPC")
+(cd "$project" && "$kpc" --batch . > /dev/null 2>&1
+  "$kpc" --batch . 2>/dev/null | grep '^Found') > "$project/found"
+echo "Found 2 translation units in ." > "$project/expected"
+check "batch over a tree with out/" "$project/expected" "$project/found"
+rm -rf "$project"
+
+exit $status